@@ -35,7 +35,8 @@ EXPORT
  *
  * @param[in] spheres spheres to render
  *
- * @return a pointer to the resulting image
+ * @return a pointer to the resulting image, or NULL if the renderer could
+ * not allocate its buffers for n_spheres spheres
  */
 const float *render(struct renderer_state* state, const sphere_t *spheres, int n_spheres);
 
@@ -15,6 +15,8 @@ EXPORT
  * called more than once.
  *
  * @param[in] spec initial spec
+ *
+ * @return the new simulator, or NULL if it could not be allocated
  */
 struct simulator_state* init_simulator(const simulator_spec_t *spec);
 
@@ -149,6 +149,7 @@ static tdiff_t run_tier_desc(const tier_desc_t *const desc, tier_timing_t* tier_
   }
 
   fasttime_t stop = gettime();
+  tier_timing->sim_stats = simulator_stats(state_s);
   destroy_renderer(state_r);
   destroy_simulator(state_s);
 
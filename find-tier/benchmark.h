@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "../libstudent/include/simulate_ext.h" // sim_stats_t
 #include "./fasttime.h" // tdiff_t
 
 typedef int8_t tier_t;
@@ -33,11 +34,13 @@ typedef struct tier_spec_t {
 } tier_spec_t;
 
 /**
- * @brief A representation of the render and simulate timings of a tier run
+ * @brief A representation of the render and simulate timings of a tier run,
+ * along with the counters the student simulator collected during it.
 */
 typedef struct tier_timing_t {
   tdiff_t simulate_timing;
   tdiff_t render_timing;
+  sim_stats_t sim_stats;
 } tier_timing_t;
 
 /**
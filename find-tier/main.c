@@ -1,8 +1,10 @@
 #include <getopt.h>   // optarg, optind
 #include <inttypes.h> // PRIu64
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "../libstudent/include/tuning.h"
 #include "../vtable.h"
 #include "./benchmark.h"
 
@@ -20,16 +22,24 @@ struct opts {
   tier_t min_tier;
   tier_t max_tier;
   tier_t blowthroughs;
+  bool sim_stats;
+  // Tuning file to load grain sizes from (-t) or to calibrate into (-T).
+  const char *tuning_in;
+  const char *tuning_out;
 };
 
+// Set by -S; read by the pass/fail callbacks.
+static bool print_sim_stats_enabled;
+
 static void usage() {
-  fprintf(stderr, "./find-tier [-m min_tier] [-M max_tier] [-b blowthroughs]\n");
+  fprintf(stderr, "./find-tier [-m min_tier] [-M max_tier] [-b blowthroughs] [-S] "
+                  "[-t tuning_file | -T tuning_file]\n");
 }
 
 static int argparse(int argc, char *const argv[], struct opts *const o) {
   int ch;
 
-  while ((ch = getopt(argc, argv, "m:M:b:")) != -1) {
+  while ((ch = getopt(argc, argv, "m:M:b:St:T:")) != -1) {
     switch (ch) {
     case 'm':
       if (1 != sscanf(optarg, "%hhu", &o->min_tier)) {
@@ -46,6 +56,15 @@ static int argparse(int argc, char *const argv[], struct opts *const o) {
         goto error;
       }
       break;
+    case 'S':
+      o->sim_stats = true;
+      break;
+    case 't':
+      o->tuning_in = optarg;
+      break;
+    case 'T':
+      o->tuning_out = optarg;
+      break;
     default:
       goto error;
     }
@@ -66,10 +85,43 @@ static void apply_defaults(struct opts *o) {
   o->blowthroughs = 2;
   o->max_tier = MAX_TIER;
   o->min_tier = MIN_TIER;
+  o->sim_stats = false;
+  o->tuning_in = NULL;
+  o->tuning_out = NULL;
 }
 
 const tdiff_t DEFAULT_CUTOFF = 2000;
 
+static void print_sim_stats(const sim_stats_t *stats) {
+  if (!stats->enabled) {
+    printf("\tsimulator stats unavailable: rebuild libstudent with SIM_STATS=1\n");
+    return;
+  }
+
+  printf("\tframes: %" PRIu64 "\tministeps: %" PRIu64 "\tcollisions: %" PRIu64
+         "\n",
+         stats->frames, stats->ministeps, stats->collisions);
+  printf("\tcollision checks: %" PRIu64 "\tearly rejects: %" PRIu64
+         "\tcandidate refreshes: %" PRIu64 "\n",
+         stats->collision_checks, stats->early_rejects, stats->candidate_refreshes);
+
+  printf("\tministeps/frame:");
+  for (int b = 0; b < SIM_STATS_HIST_BUCKETS; b++) {
+    if (stats->ministep_hist[b] != 0) {
+      printf(" [%llu, %llu): %" PRIu64, 1ull << b, 1ull << (b + 1),
+             stats->ministep_hist[b]);
+    }
+  }
+  printf("\n");
+
+  printf("\tphase ms:");
+  for (int p = 0; p < SIM_N_PHASES; p++) {
+    printf(" %s %.1f", sim_phase_name((sim_phase_e)p),
+           (double)stats->phase_ns[p] / 1e6);
+  }
+  printf("\n");
+}
+
 static void print_tier_pass_message(tier_t tier_passed, const tier_spec_t *spec,
                                     tdiff_t time_elapsed, tier_timing_t* tier_timing) {
   // For some fun!
@@ -84,6 +136,9 @@ static void print_tier_pass_message(tier_t tier_passed, const tier_spec_t *spec,
          "ms (s: %" PRIu64 ", r: %" PRIu64 ")\n",
          random_celebration, tier_passed, spec->width, spec->height,
          spec->n_spheres, time_elapsed, tier_timing->simulate_timing, tier_timing->render_timing);
+  if (print_sim_stats_enabled) {
+    print_sim_stats(&tier_timing->sim_stats);
+  }
 }
 
 static void print_tier_fail_message(tier_t tier_failed, const tier_spec_t *spec,
@@ -96,6 +151,9 @@ static void print_tier_fail_message(tier_t tier_failed, const tier_spec_t *spec,
       tier_failed, spec->width, spec->height, spec->n_spheres, time_elapsed,
       tier_timing->simulate_timing, tier_timing->render_timing,
       DEFAULT_CUTOFF, blowthroughs_used);
+  if (print_sim_stats_enabled) {
+    print_sim_stats(&tier_timing->sim_stats);
+  }
 }
 
 static void display_result(const bench_result_t *result,
@@ -123,6 +181,9 @@ static void validate_opts(const struct opts *o) {
   } else if (o->blowthroughs < 0) {
     fprintf(stderr, ERR_PREFIX "blowthrough count must be non-negative\n");
     exit(1);
+  } else if (o->tuning_in != NULL && o->tuning_out != NULL) {
+    fprintf(stderr, ERR_PREFIX "cannot both load and calibrate a tuning file\n");
+    exit(1);
   }
 }
 
@@ -135,6 +196,16 @@ int main(int argc, char *const argv[]) {
   }
 
   validate_opts(&o);
+  print_sim_stats_enabled = o.sim_stats;
+
+  if (o.tuning_in != NULL && tuning_load(o.tuning_in) != 0) {
+    fprintf(stderr, ERR_PREFIX "could not load tuning file %s\n", o.tuning_in);
+    exit(1);
+  }
+  if (o.tuning_out != NULL) {
+    printf(COLOR_YELLOW "Calibrating grain sizes; tier times include calibration" COLOR_DEFAULT "\n");
+    tuning_set_calibrate(true);
+  }
 
   bench_spec_t spec = {
       .blowthroughs = o.blowthroughs,
@@ -153,5 +224,9 @@ int main(int argc, char *const argv[]) {
       run_benchmark(&spec, print_tier_pass_message, print_tier_fail_message);
   display_result(&result, &spec);
 
+  if (o.tuning_out != NULL && tuning_save(o.tuning_out) != 0) {
+    fprintf(stderr, ERR_PREFIX "could not write tuning file %s\n", o.tuning_out);
+  }
+
   teardown();
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "../common/types.h"
+#include "../libstudent/include/simulate_ext.h"
 #include "../serde.h"
 #include "../vtable.h"
 #include <stdio.h>
@@ -11,19 +12,21 @@ struct opts {
   const char *s_filename;
   const char *r_filename;
   const char *out_filename;
+  const char *event_log_filename;
   size_t n_frames;
 };
 
 
-static void usage() { fprintf(stderr, "./gen_eframes [-r -s] sim_spec renderer_spec output_file\nBy default uses staff simulator and renderer, -r and -s switch to student versions.\n"); }
+static void usage() { fprintf(stderr, "./gen_eframes [-r -s] [-l event_log] sim_spec renderer_spec output_file\nBy default uses staff simulator and renderer, -r and -s switch to student versions.\n-l writes every collision the student simulator resolves to event_log (requires -s).\n"); }
 
 static int argparse(int argc, char *const argv[], struct opts *const o) {
   bool staff_renderer = true;
   bool staff_simulator = true;
   o->n_frames = 12;
+  o->event_log_filename = NULL;
   int ch;
 
-  while ((ch = getopt(argc, argv, "n:rs")) != -1) {
+  while ((ch = getopt(argc, argv, "n:rsl:")) != -1) {
     switch (ch) {
       case 'n':
       if (1 != sscanf(optarg, "%zu", &o->n_frames))
@@ -35,6 +38,9 @@ static int argparse(int argc, char *const argv[], struct opts *const o) {
     case 's':
       staff_simulator = false;
       break;
+    case 'l':
+      o->event_log_filename = optarg;
+      break;
     default:
       goto error;
     }
@@ -49,6 +55,9 @@ static int argparse(int argc, char *const argv[], struct opts *const o) {
   o->s_filename = argv[0];
   o->r_filename = argv[1];
   o->out_filename = argv[2];
+  if (o->event_log_filename != NULL && staff_simulator) {
+    goto error;
+  }
   if (staff_renderer && staff_simulator) {
     o->vtable = staff_all();
   } else if (!staff_renderer && staff_simulator) {
@@ -99,6 +108,12 @@ int main(int argc, char *const argv[]) {
 
   init_impl(&o.vtable, &r_spec, &s_spec);
 
+  if (o.event_log_filename != NULL &&
+      simulator_open_event_log(o.vtable.simulate_this, o.event_log_filename, 0)) {
+    fprintf(stderr, "gen_eframes: could not open event log %s\n", o.event_log_filename);
+    exit(1);
+  }
+
   frames_t out = {
       .height = r_spec.resolution,
       .width = r_spec.resolution,
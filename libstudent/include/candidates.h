@@ -0,0 +1,89 @@
+#ifndef CANDIDATES_H
+#define CANDIDATES_H
+
+#include <stdbool.h>
+
+#include "../../common/types.h"
+#include "hgrid.h"
+
+// Collision candidates kept across frames.
+//
+// check_for_collision rejects a pair outright when the two spheres cannot
+// close the gap between them within the horizon T:
+//
+//   gap(i, j) = |p_i - p_j| - (r_i + r_j) - T * |v_i - v_j| > 0
+//
+// and since that test only gets stricter as T shrinks, a pair that fails it
+// at the frame horizon fails it for every ministep of the frame as well.
+// Scanning only the pairs that might pass it, in ascending index order,
+// therefore gives exactly the same collision table as scanning all of
+// them.
+//
+// Each sphere remembers the position and velocity it had when its
+// candidates were last computed. Moving it by dp and changing its
+// velocity by dv changes the gap of any pair it is in by at most its drift
+// |dp| + T * |dv|. Pairs are only dropped from the lists when their gap
+// exceeds a skin S, so as long as every sphere has drifted by at most S / 2
+// the lists still hold every pair that might pass. Spheres that drift
+// further get their lists recomputed, which costs O(n) each instead of the
+// O(n^2) of a full scan.
+//
+// Full rebuilds find the pairs through a hierarchical grid (see hgrid.h)
+// in which each sphere reaches as far as its radius, its travel over the
+// horizon and half the skin. That keeps them close to linear in the number
+// of spheres and pairs however much the radii vary.
+
+typedef struct {
+  // Sorted indices of the spheres that might collide with this one.
+  int *adj;
+  int deg;
+  int cap;
+  // Set when the list could not grow; it is then missing pairs.
+  bool failed;
+} candidate_list_t;
+
+typedef struct {
+  int n_spheres;
+  bool built;
+  float horizon;
+  float skin;
+  vector_t *ref_pos;
+  vector_t *ref_vel;
+  candidate_list_t *lists;
+  // Total list length as of the last full rebuild.
+  long n_pairs;
+  // Spheres found over budget by the last candidates_update.
+  int *stale;
+  bool *is_stale;
+  // Broad phase for full rebuilds; if it could not be allocated, rebuilds
+  // test every pair instead.
+  hgrid_t grid;
+  bool use_grid;
+  double *reach;
+} candidate_set_t;
+
+/**
+ * @brief Return the position where j is, or would go, in list.
+ */
+int candidate_list_find(const candidate_list_t *list, int j);
+
+/**
+ * @brief Allocate an empty set for n_spheres spheres.
+ *
+ * @return 0 on success, nonzero on allocation failure
+ */
+int candidates_init(candidate_set_t *c, int n_spheres);
+
+void candidates_destroy(candidate_set_t *c);
+
+/**
+ * @brief Bring the lists up to date with spheres[0, n_spheres) for the
+ * given horizon, recomputing the lists of every sphere that drifted out of
+ * its budget (or all of them, if horizon changed or too many did).
+ *
+ * @return the number of spheres whose lists were recomputed, or -1 if a
+ * list could not be allocated, after which the lists must not be used
+ */
+int candidates_update(candidate_set_t *c, const sphere_t *spheres, float horizon);
+
+#endif // CANDIDATES_H
@@ -0,0 +1,69 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "./simulate_ext.h"
+
+#define EVENT_LOG_CACHE_LINE 64
+
+/**
+ * @brief Single-producer, single-consumer ring of collision events.
+ *
+ * The simulator's event loop is the only producer and a background thread
+ * is the only consumer, so the ring needs no locks: the producer owns
+ * `head`, the consumer owns `tail`, and each side only reads the other's
+ * index. When the ring is full the producer drops the event and counts it
+ * instead of waiting, so a slow disk never stalls the simulation.
+ */
+typedef struct event_log {
+  // Producer side.
+  _Alignas(EVENT_LOG_CACHE_LINE) _Atomic size_t head;
+  uint64_t dropped;
+  uint64_t frame;
+
+  // Consumer side.
+  _Alignas(EVENT_LOG_CACHE_LINE) _Atomic size_t tail;
+  FILE *out;
+
+  // Shared, read-only after creation.
+  _Alignas(EVENT_LOG_CACHE_LINE) collision_event_t *ring;
+  size_t mask;
+  atomic_bool closing;
+  pthread_t consumer;
+} event_log_t;
+
+/**
+ * @brief Create a log writing to path, with room for at least capacity
+ * in-flight events, and start its consumer thread.
+ *
+ * @return the new log, or NULL if the file or thread could not be created
+ */
+event_log_t *event_log_open(const char *path, size_t capacity);
+
+/**
+ * @brief Drain everything still in the ring, stop the consumer thread, and
+ * close the file.
+ */
+void event_log_close(event_log_t *log);
+
+/**
+ * @brief Append an event. Must only be called from the simulator thread.
+ */
+inline __attribute__((always_inline))
+static void event_log_push(event_log_t *log, const collision_event_t *event) {
+  size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+  if (head - tail > log->mask) {
+    log->dropped++;
+    return;
+  }
+  log->ring[head & log->mask] = *event;
+  atomic_store_explicit(&log->head, head + 1, memory_order_release);
+}
+
+#endif // EVENT_LOG_H
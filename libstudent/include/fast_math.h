@@ -0,0 +1,103 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <math.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../../common/types.h"
+#include "./sim_stats.h"
+
+// Native single-precision counterparts of the misc_utils.h helpers, for the
+// simulator's SIM_PRECISION_FAST mode. Unlike qsubtract and friends they
+// never round-trip through double, so they are free to use FMA and to
+// vectorize, at the cost of no longer matching the staff reference
+// bit-for-bit.
+
+inline __attribute__((always_inline))
+static vector_t fsubtract(vector_t v1, vector_t v2) {
+  vector_t v = {v1.x - v2.x, v1.y - v2.y, v1.z - v2.z};
+  return v;
+}
+
+inline __attribute__((always_inline))
+static float fdot(vector_t v1, vector_t v2) {
+  return fmaf(v1.x, v2.x, fmaf(v1.y, v2.y, v1.z * v2.z));
+}
+
+// v1 + c * v2
+inline __attribute__((always_inline))
+static vector_t fadd_scaled(vector_t v1, float c, vector_t v2) {
+  vector_t v = {fmaf(c, v2.x, v1.x), fmaf(c, v2.y, v1.y), fmaf(c, v2.z, v1.z)};
+  return v;
+}
+
+// 1 / sqrt(x) from the hardware estimate plus one Newton-Raphson step,
+// good to about 22 bits.
+inline __attribute__((always_inline))
+static float frsqrt(float x) {
+#ifdef __AVX2__
+  float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+  return y * fmaf(-0.5f * x * y, y, 1.5f);
+#else
+  return 1.0f / sqrtf(x);
+#endif
+}
+
+#ifdef __AVX2__
+// Eight-wide frsqrt.
+inline __attribute__((always_inline))
+static __m256 frsqrt8(__m256 x) {
+  __m256 y = _mm256_rsqrt_ps(x);
+  __m256 half_xy = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(-0.5f), x), y);
+  return _mm256_mul_ps(y, _mm256_fmadd_ps(half_xy, y, _mm256_set1_ps(1.5f)));
+}
+#endif
+
+// Single-precision version of check_for_collision in simulate.c; follows
+// the same steps, so see there for what each test means.
+inline __attribute__((always_inline))
+static int check_for_collision_fast(const sphere_t *spheres, int i, int j, float *timeToCollision,
+                                    scan_counts_t *counts) {
+  SIM_STATS_COUNT(counts, calls);
+  vector_t distVec = fsubtract(spheres[i].pos, spheres[j].pos);
+  float distSq = fdot(distVec, distVec);
+  float dist = sqrtf(distSq);
+  float sumRadii = spheres[i].r + spheres[j].r;
+
+  vector_t movevec = fsubtract(spheres[j].vel, spheres[i].vel);
+  float moveSq = fdot(movevec, movevec);
+  if (moveSq == 0) {
+    SIM_STATS_COUNT(counts, early_rejects);
+    return 0;
+  }
+  float invMove = frsqrt(moveSq);
+  float moveLen = moveSq * invMove;
+  float moveDist = moveLen * *timeToCollision;
+  if (moveDist < dist - sumRadii) {
+    SIM_STATS_COUNT(counts, early_rejects);
+    return 0;
+  }
+
+  float distAlongMovevec = fdot(movevec, distVec) * invMove;
+  if (distAlongMovevec <= 0) {
+    return 0;
+  }
+
+  float sumRadiiSquared = sumRadii * sumRadii;
+  float jToMovevecDistSq = fmaf(-distAlongMovevec, distAlongMovevec, distSq);
+  if (jToMovevecDistSq >= sumRadiiSquared) {
+    return 0;
+  }
+
+  float distance = distAlongMovevec - sqrtf(sumRadiiSquared - jToMovevecDistSq);
+  if (distance < 0 || moveDist < distance) {
+    return 0;
+  }
+
+  *timeToCollision = distance * invMove;
+  return 1;
+}
+
+#endif // FAST_MATH_H
@@ -0,0 +1,72 @@
+#ifndef HGRID_H
+#define HGRID_H
+
+#include <stdint.h>
+
+#include "../../common/types.h"
+
+// Hierarchical grid over points with a reach each.
+//
+// Level L has cubic cells of side base * 2^L, and every point goes into the
+// smallest level whose cells are at least twice its reach across. Two
+// points closer than the sum of their reaches are then in the same or
+// neighbouring cells of the higher of their two levels, so searching the
+// 3x3x3 block around a point on its own level and every level above it
+// finds all the points it is within reach of that sit on those levels.
+// Points on lower levels find it in turn. Tiny debris and a sun-sized body
+// thus each get cells that fit them, where a single cell size would either
+// put all the debris in one cell or have the sun span millions.
+//
+// Points the grid cannot place (non-finite, or too far out for the cell
+// coordinates) are left out of every cell and reported as level -1;
+// callers have to pair those with everything themselves.
+
+typedef struct {
+  int level;
+  int64_t x, y, z;
+  // Range of order holding the cell's points; count 0 marks an empty slot.
+  int start;
+  int count;
+} hgrid_cell_t;
+
+typedef struct {
+  int n_points;
+  double base;
+  int n_levels;
+  // Per point.
+  int *level;
+  // Point indices grouped by cell.
+  int *order;
+  // Open-addressed table of the occupied cells.
+  hgrid_cell_t *cells;
+  int cells_cap;
+} hgrid_t;
+
+/**
+ * @brief Allocate a grid for up to n_points points.
+ *
+ * @return 0 on success, nonzero on allocation failure
+ */
+int hgrid_init(hgrid_t *grid, int n_points);
+
+void hgrid_destroy(hgrid_t *grid);
+
+/**
+ * @brief Place points pos[0, n_points) with the given reaches, replacing
+ * whatever the grid held before.
+ */
+void hgrid_build(hgrid_t *grid, const vector_t *pos, const double *reach);
+
+// Called for every point a query finds.
+typedef void (*hgrid_visit_t)(int j, void *arg);
+
+/**
+ * @brief Call visit on every point other than i that sits on i's level or
+ * above, in a cell next to or at the one holding pos on that level. pos is
+ * normally point i's position from the last hgrid_build.
+ *
+ * Must not be called for points on level -1.
+ */
+void hgrid_query_up(const hgrid_t *grid, int i, vector_t pos, hgrid_visit_t visit, void *arg);
+
+#endif // HGRID_H
@@ -0,0 +1,38 @@
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include "./simulate_ext.h"
+
+// Simulation state of an out-of-core simulator (see
+// init_simulator_out_of_core). Everything proportional to the sphere count
+// lives in one memory-mapped scratch file; only the chunk summaries and the
+// pending collision events are kept in memory.
+
+typedef struct out_of_core out_of_core_t;
+
+/**
+ * @brief Map a scratch file for spec's spheres and copy them into it.
+ *
+ * @return the new state, or NULL if options are invalid or the file could
+ * not be created
+ */
+out_of_core_t *out_of_core_create(const simulator_spec_t *spec,
+                                  const sim_out_of_core_options_t *options);
+
+void out_of_core_destroy(out_of_core_t *ooc);
+
+/**
+ * @brief Return the spheres in their original order, as of the last
+ * out_of_core_frame. The array lives in the scratch file.
+ */
+sphere_t *out_of_core_spheres(out_of_core_t *ooc);
+
+/**
+ * @brief Advance the spheres by one frame.
+ *
+ * @return how many collisions the frame resolved, or -1 if the collision
+ * events could not be allocated (the frame is then left part way through)
+ */
+int out_of_core_frame(out_of_core_t *ooc);
+
+#endif // OUT_OF_CORE_H
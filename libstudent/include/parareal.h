@@ -0,0 +1,50 @@
+#ifndef PARAREAL_H
+#define PARAREAL_H
+
+#include <stdbool.h>
+
+#include "./simulate_ext.h"
+
+// Window bookkeeping for the simulator's Parareal mode (see
+// sim_parareal_options_t). simulate() asks for each frame with
+// parareal_next_frame and runs the frame itself whenever that declines.
+
+typedef struct parareal parareal_t;
+
+/**
+ * @brief Set up a window for spec's sphere count and gravity, with one
+ * fine simulator per frame of it, started from spec's spheres.
+ *
+ * @return the new window, or NULL if options are invalid or allocation
+ * failed
+ */
+parareal_t *parareal_create(const simulator_spec_t *spec, const sim_parareal_options_t *options);
+
+void parareal_destroy(parareal_t *p);
+
+/**
+ * @brief Write the frame after spheres[0, n_spheres) into spheres, working
+ * out a new window from it first if the current one is used up.
+ *
+ * Fine frames run on simulators of the given precision.
+ *
+ * @return false if the caller has to run this frame sequentially, which
+ * includes when the fine simulators cannot switch to precision
+ */
+bool parareal_next_frame(parareal_t *p, sphere_t *spheres, sim_precision_e precision);
+
+sim_parareal_stats_t parareal_stats(const parareal_t *p);
+
+/**
+ * @brief Return how many collisions the last simulate() call on state
+ * resolved. Defined in simulate.c.
+ */
+int simulator_frame_collisions(const struct simulator_state *state);
+
+/**
+ * @brief Start state over from spheres[0, n_spheres), as if init_simulator
+ * had been called on them, but keeping its buffers. Defined in simulate.c.
+ */
+void simulator_restart(struct simulator_state *state, const sphere_t *spheres);
+
+#endif // PARAREAL_H
@@ -0,0 +1,59 @@
+#ifndef RENDER_BVH_H
+#define RENDER_BVH_H
+
+// Bounding volume hierarchy over screen-space boxes, for the renderer's
+// RENDER_VISIBILITY_BVH mode.
+//
+// Boxes use the layout of render.c's bounding regions: box i is
+// boxes[4 * i, 4 * i + 4) = {x_max, y_max, x_min, y_min}, covering the
+// pixels x_min <= x < x_max, y_min <= y < y_max. Items are numbered in the
+// order the spheres are drawn, and every node remembers the lowest item
+// under it, so a query can skip whole subtrees once it has found a hit in
+// front of them.
+
+typedef struct {
+  int x_min, y_min, x_max, y_max;
+  // Lowest item under the node.
+  int first;
+  // Children, or -1 for a leaf, whose items are order[start, start + count)
+  // in ascending order.
+  int left, right;
+  int start, count;
+} render_bvh_node_t;
+
+typedef struct {
+  int capacity;
+  int n_nodes;
+  render_bvh_node_t *nodes;
+  // Items with nonempty boxes, grouped by leaf.
+  int *order;
+} render_bvh_t;
+
+/**
+ * @brief Allocate a hierarchy for up to n_items items.
+ *
+ * @return 0 on success, nonzero on allocation failure
+ */
+int render_bvh_init(render_bvh_t *bvh, int n_items);
+
+void render_bvh_destroy(render_bvh_t *bvh);
+
+/**
+ * @brief Build the hierarchy over boxes[0, 4 * n_items), replacing
+ * whatever it held before. Items with empty boxes are left out.
+ */
+void render_bvh_build(render_bvh_t *bvh, const int *boxes, int n_items);
+
+// Whether item's sphere is hit by the ray of the pixel being queried; if
+// so, also writes the distance to the hit to *t.
+typedef int (*render_bvh_hit_t)(int item, void *arg, float *t);
+
+/**
+ * @brief Return the lowest item whose box holds pixel (x, y) and for which
+ * hit returns true, or -1 if there is none. *t is the distance hit
+ * reported for it.
+ */
+int render_bvh_first_hit(const render_bvh_t *bvh, const int *boxes, int x, int y,
+                         render_bvh_hit_t hit, void *arg, float *t);
+
+#endif // RENDER_BVH_H
@@ -0,0 +1,39 @@
+#ifndef RENDER_CULL_H
+#define RENDER_CULL_H
+
+#include <stdbool.h>
+
+#include "../../common/render.h"
+#include "./render_span.h"
+
+// Culling of spheres no primary ray can hit, for render() to drop before
+// sorting.
+//
+// Every primary ray starts at the eye and lies on the inner side of five
+// planes through it: the four sides of the view pyramid and the plane
+// facing the centre of the view. A sphere wholly on the outer side of one
+// of them is out of view or behind the eye. The exact test in
+// render_kernels.h also never reports a hit on a sphere the eye is inside.
+// Like spans, the tests are conservative: the view is widened by a pixel
+// and spheres are enlarged (or shrunk, for the eye test) slightly, so a
+// sphere is only dropped when the exact test cannot hit it.
+
+typedef struct {
+  double eye[3];
+  // Unit normals of the five planes, pointing into the view.
+  double normal[5][3];
+} view_frustum_t;
+
+/**
+ * @brief Set frustum up for the primary rays of camera, on an image
+ * resolution pixels across.
+ */
+void view_frustum_init(view_frustum_t *frustum, const span_camera_t *camera, int resolution);
+
+/**
+ * @brief Whether some primary ray might hit the sphere at pos with radius r.
+ * True whenever the answer depends on a NaN.
+ */
+bool view_frustum_may_show(const view_frustum_t *frustum, vector_t pos, float r);
+
+#endif // RENDER_CULL_H
@@ -0,0 +1,76 @@
+#ifndef RENDER_EXT_H
+#define RENDER_EXT_H
+
+#include "../../common/render.h"
+
+// Extensions to the renderer API in common/render.h. Like the ones in
+// simulate_ext.h, these are only provided by libstudent.
+
+typedef enum {
+  // Walk the spheres front to back and test the pixels of each one's
+  // screen-space bounding box that no nearer sphere has covered yet.
+  RENDER_VISIBILITY_RASTER,
+  // Build a bounding volume hierarchy over the spheres' screen-space
+  // bounding boxes each frame and trace every pixel through it, stopping
+  // at the front-most sphere the pixel's ray hits.
+  RENDER_VISIBILITY_BVH,
+} render_visibility_e;
+
+EXPORT
+/**
+ * @brief Resolve visibility the given way from the next render() call on.
+ * New renderers start in RENDER_VISIBILITY_RASTER. Both ways produce the
+ * same image.
+ *
+ * @return 0 on success, nonzero if visibility is not a known mode (state
+ * is left unchanged)
+ */
+int renderer_set_visibility(struct renderer_state *state, render_visibility_e visibility);
+
+EXPORT
+/**
+ * @brief Return the way state currently resolves visibility.
+ */
+render_visibility_e renderer_visibility(const struct renderer_state *state);
+
+typedef enum {
+  // Matches the staff reference bit-for-bit: the packet kernels round
+  // through double at every step the scalar ones in render_kernels.h do.
+  RENDER_PRECISION_EXACT,
+  // Native single precision with FMA, and rsqrt plus a Newton step instead
+  // of sqrt and divide when normalizing. Faster, but pixels can differ
+  // from the reference in the last bits, and on silhouettes.
+  RENDER_PRECISION_FAST,
+} render_precision_e;
+
+EXPORT
+/**
+ * @brief Rasterize in the given precision from the next render() call on.
+ * New renderers start in RENDER_PRECISION_EXACT. RENDER_VISIBILITY_BVH
+ * always traces in RENDER_PRECISION_EXACT but shades in this precision,
+ * and without AVX2 both precisions run the scalar kernels.
+ *
+ * @return 0 on success, nonzero if precision is not a known mode (state is
+ * left unchanged)
+ */
+int renderer_set_precision(struct renderer_state *state, render_precision_e precision);
+
+EXPORT
+/**
+ * @brief Return the precision state currently rasterizes in.
+ */
+render_precision_e renderer_precision(const struct renderer_state *state);
+
+EXPORT
+/**
+ * @brief Copy out the visibility buffer of the last image render()
+ * returned: for every pixel, row by row, the index in the spheres passed
+ * to render() of the sphere the pixel shows, or -1 if it shows none, to
+ * ids, and the distance along the pixel's ray to that sphere (infinity if
+ * none) to t. Both hold resolution * resolution entries; t may be NULL.
+ *
+ * @return 0 on success, nonzero if state has not rendered anything yet
+ */
+int renderer_visibility_buffer(const struct renderer_state *state, int *ids, float *t);
+
+#endif // RENDER_EXT_H
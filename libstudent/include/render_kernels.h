@@ -0,0 +1,156 @@
+#ifndef RENDER_KERNELS_H
+#define RENDER_KERNELS_H
+
+#include "../../common/render.h"
+#include "./misc_utils.h"
+#include "./render_ext.h"
+
+// Renderer kernels shared by render.c and the packet code in
+// render_packet.c. The scalar ones here are the reference: the packet
+// kernels in RENDER_PRECISION_EXACT reproduce them bit for bit.
+//
+// Drawing is deferred. Visibility is resolved first, into a buffer that
+// holds the sphere each pixel shows and how far along the pixel's ray it
+// is, and shading then runs over whole packets of pixels from that buffer.
+
+// The parts of a sphere rendering reads, gathered in drawing order so the
+// per-pixel loops touch half the memory a sphere_t takes.
+typedef struct {
+  vector_t pos;
+  float r;
+  material_t mat;
+} render_sphere_t;
+
+// Determines whether the ray r and the sphere s intersect.
+// 
+// If the ray and the sphere intersect, writes the distance to the closer intersection
+// to `out`, and returns 1. Otherwise, returns 0.
+inline __attribute__((always_inline))
+static int ray_sphere_intersection(const ray_t *r, const render_sphere_t* s, float *out) {
+  vector_t dist = qsubtract(r->origin, s->pos);
+  // Uses quadratic formula to compute intersection
+  float a = qdot(r->dir, r->dir);
+  float b = 2 * qdot(r->dir, dist);
+  float c = (float)((double)qdot(dist, dist) - (double)(s->r * s->r));
+  float discr = (float)((double)(b * b) - (double)(4 * a * c));
+
+  if (discr >= 0) {
+    // Ray hits sphere
+    float sqrtdiscr = sqrtf(discr);
+
+    float min_dist;
+    if (b >= 0) {
+      float sol1 = (float)((double)-b - (double)sqrtdiscr) / (2 * a);
+      float sol2 = (float)(2 * (double)c) / ((double)-b - (double)sqrtdiscr);
+      min_dist = min(sol1, sol2);
+    } else {
+      float sol1 = (float)(2 * (double)c) / ((double)-b + (double)sqrtdiscr);
+      float sol2 = (float)((double)-b + (double)sqrtdiscr) / (2 * a);
+      min_dist = min(sol1, sol2);
+    }
+
+    // If new_t > 0 and smaller than original t, we
+    // found a new, closer ray-sphere intersection
+    if (min_dist > 0) {
+      *out = min_dist;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Lights pixel (x, y), whose ray hits sphere at distance t, with the
+// Lambert term of every light on the sphere's side of the hit.
+inline __attribute__((always_inline))
+static void shade_pixel(const renderer_spec_t* spec, float* img, const render_sphere_t* sphere,
+                        const ray_t* ray, float t, int x, int y) {
+  material_t currentMat = sphere->mat;
+  vector_t intersection = qadd(ray->origin, scale(t, ray->dir));
+
+  // Normal vector at intersection point, perpendicular to the surface
+  // of the sphere
+  vector_t normal = qsubtract(intersection, sphere->pos);
+  float n_size = qsize(normal);
+  // Note: n_size should be the radius of the sphere, which is nonzero.
+  normal = scale(1 / n_size, normal);
+
+  double red = 0;
+  double green = 0; 
+  double blue = 0; 
+
+  for (int j = 0; j < spec->n_lights; j++) {
+    light_t currentLight = spec->lights[j];
+    vector_t intersection_to_light = qsubtract(currentLight.pos, intersection);
+    if (qdot(normal, intersection_to_light) <= 0)
+      continue;
+
+    ray_t lightRay;
+    lightRay.origin = intersection;
+    lightRay.dir = scale(1 / qsize(intersection_to_light), intersection_to_light);
+
+    // Calculate Lambert diffusion
+    float lambert = qdot(lightRay.dir, normal);
+    red += (double)(currentLight.intensity.red * currentMat.diffuse.red *
+                    lambert);
+    green += (double)(currentLight.intensity.green *
+                      currentMat.diffuse.green * lambert);
+    blue += (double)(currentLight.intensity.blue * currentMat.diffuse.blue *
+                    lambert);
+  }
+  img[(x + y * spec->resolution) * 3 + 0] = min((float)red, 1.0);
+  img[(x + y * spec->resolution) * 3 + 1] = min((float)green, 1.0);
+  img[(x + y * spec->resolution) * 3 + 2] = min((float)blue, 1.0);
+}
+
+// Pixels per packet.
+#define RENDER_LANES 8
+
+// The spec's lights, one field per array.
+typedef struct {
+  int n;
+  float *x, *y, *z;
+  float *red, *green, *blue;
+} render_lights_t;
+
+/**
+ * @brief Copy the lights of spec into lights.
+ *
+ * @return 0 on success, nonzero on allocation failure
+ */
+int render_lights_init(render_lights_t *lights, const renderer_spec_t *spec);
+
+void render_lights_destroy(render_lights_t *lights);
+
+// What the packet kernels work on: the camera, the primary ray directions
+// one component per array, the spheres in drawing order, the lights, the
+// visibility buffer and the image.
+typedef struct {
+  const renderer_spec_t *spec;
+  const float *dir_x, *dir_y, *dir_z;
+  const render_sphere_t *spheres;
+  const render_lights_t *lights;
+  // Per pixel, the index in spheres of the sphere the pixel shows, or -1,
+  // and the distance along the pixel's ray to it.
+  int *ids;
+  float *t;
+  float *img;
+} render_target_t;
+
+/**
+ * @brief Test the pixels x + k of row y for which bit k of live is set,
+ * where live only has bits below count <= RENDER_LANES, against sphere id,
+ * and record it in the visibility buffer for the ones it hits.
+ *
+ * @return the bits of live whose pixels were hit
+ */
+int intersect_packet(const render_target_t *target, int id, int x, int y, int count, int live,
+                     render_precision_e precision);
+
+/**
+ * @brief Shade the pixels [x, x + count) of row y, count <= RENDER_LANES,
+ * from the visibility buffer. Pixels that show no sphere are set to black.
+ */
+void shade_packet(const render_target_t *target, int x, int y, int count, render_precision_e precision);
+
+#endif // RENDER_KERNELS_H
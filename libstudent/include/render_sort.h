@@ -0,0 +1,64 @@
+#ifndef RENDER_SORT_H
+#define RENDER_SORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Depth ordering for the renderer.
+//
+// The order has to match the staff renderer's insertion sort exactly,
+// including how it treats keys that do not compare like ordinary numbers:
+//
+// - Equal keys (and -0 and +0 count as equal) keep their input order.
+// - Insertion sort never moves anything past a NaN key, so NaNs split the
+//   input into segments that are sorted independently, each followed by
+//   the NaN that ends it.
+//
+// depth_sort reproduces that with a stable LSD radix sort on 64-bit keys
+// made of the segment number and an order-preserving integer image of the
+// float key. Ties broken by input index make that order unique, so
+// depth_sort_update can reach it by repairing an older order instead.
+
+typedef struct {
+  int capacity;
+  uint64_t *keys, *keys_tmp;
+  int *order_tmp;
+  // Per-block tables of the parallel passes, which never cut the keys into
+  // more than max_blocks blocks whatever their tuned grain.
+  int max_blocks;
+  int *counts;
+  uint32_t *nans;
+  bool *sorted;
+} depth_sort_t;
+
+/**
+ * @brief Allocate scratch space for sorting up to n_keys keys.
+ *
+ * @return 0 on success, nonzero on allocation failure
+ */
+int depth_sort_init(depth_sort_t *sort, int n_keys);
+
+void depth_sort_destroy(depth_sort_t *sort);
+
+/**
+ * @brief Whether key is a NaN, which splits the order into segments.
+ * Leaving out keys that are not barriers does not change the order of the
+ * rest, but leaving out a barrier does.
+ */
+bool depth_sort_barrier(float key);
+
+/**
+ * @brief Write the permutation that sorts keys[0, n_keys) to order, so
+ * that order[k] is the index of the k-th key in sorted order.
+ */
+void depth_sort(depth_sort_t *sort, const float *keys, int n_keys, int *order);
+
+/**
+ * @brief Like depth_sort, but order must hold a permutation of [0, n_keys),
+ * usually the previous frame's order, which it repairs in place. That is
+ * much cheaper than depth_sort when few keys have changed places, and
+ * falls back to it when many have.
+ */
+void depth_sort_update(depth_sort_t *sort, const float *keys, int n_keys, int *order);
+
+#endif // RENDER_SORT_H
@@ -0,0 +1,52 @@
+#ifndef RENDER_SPAN_H
+#define RENDER_SPAN_H
+
+#include <stdbool.h>
+
+#include "../../common/render.h"
+#include "./render_kernels.h"
+
+// Per-row pixel spans of a sphere's silhouette, for the raster mode.
+//
+// The primary ray through pixel (x, y) runs from the eye along D(x, y) =
+// corner + x * step + y * row, so along one row the pixels whose rays pass
+// within r of the sphere's centre are the ones where a quadratic in x is
+// at most 0: an interval with closed-form ends. Spans are conservative:
+// they are worked out in double for a slightly larger sphere and widened
+// by a pixel on each side, so every pixel the exact test in
+// render_kernels.h hits lies inside them, and the exact test still
+// decides each pixel.
+
+typedef struct {
+  double eye[3];
+  // Unnormalized direction of the ray through pixel (0, 0), and how it
+  // changes from one pixel to the next along a row and down a column.
+  double corner[3], step[3], row[3];
+} span_camera_t;
+
+typedef struct {
+  // False if the silhouette is not bounded along rows (the eye is inside
+  // the sphere, or the sphere reaches around beside it); every row then
+  // spans the whole box.
+  bool bounded;
+  // Centre relative to the eye, and |w|^2 - r^2 for the enlarged radius.
+  double w[3];
+  double k;
+  // Row-independent terms of the quadratic.
+  double w_step, step_step;
+} sphere_span_t;
+
+/**
+ * @brief Set camera up for the renderer spec and pixel size.
+ */
+void span_camera_init(span_camera_t *camera, const renderer_spec_t *spec, float pixel_size);
+
+void sphere_span_init(sphere_span_t *span, const span_camera_t *camera, const render_sphere_t *sphere);
+
+/**
+ * @brief Narrow [*x_low, *x_high), a range of row y, to the pixels whose
+ * rays might hit the sphere. Leaves an empty range if none can.
+ */
+void sphere_span_row(const sphere_span_t *span, const span_camera_t *camera, int y, int *x_low, int *x_high);
+
+#endif // RENDER_SPAN_H
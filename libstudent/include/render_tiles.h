@@ -0,0 +1,45 @@
+#ifndef RENDER_TILES_H
+#define RENDER_TILES_H
+
+#include <stddef.h>
+
+// Screen-space binning of spheres into square tiles, for the renderer's
+// raster mode.
+//
+// Boxes use the layout of render.c's bounding regions (see render_bvh.h).
+// Every tile gets the list of spheres whose boxes overlap it, in the order
+// the spheres are drawn, so a tile can be rendered on its own by walking
+// just its list.
+
+// Side of a tile in pixels.
+#define RENDER_TILE 32
+
+typedef struct {
+  int resolution;
+  // Tiles per side of the image; tiles are numbered row by row.
+  int tiles_x;
+  int n_tiles;
+  // Tile k's spheres are spheres[start[k], start[k + 1]).
+  size_t *start;
+  int *spheres;
+  size_t capacity;
+} tile_bins_t;
+
+/**
+ * @brief Allocate bins for a resolution x resolution image.
+ *
+ * @return 0 on success, nonzero on allocation failure
+ */
+int tile_bins_init(tile_bins_t *bins, int resolution);
+
+void tile_bins_destroy(tile_bins_t *bins);
+
+/**
+ * @brief Bin spheres [0, n_spheres) by boxes[0, 4 * n_spheres), replacing
+ * whatever the bins held before.
+ *
+ * @return 0 on success, nonzero if the lists could not be allocated
+ */
+int tile_bins_build(tile_bins_t *bins, const int *boxes, int n_spheres);
+
+#endif // RENDER_TILES_H
@@ -0,0 +1,150 @@
+#ifndef SIM_KERNELS_H
+#define SIM_KERNELS_H
+
+#include "../../common/types.h"
+#include "./misc_utils.h"
+#include "./sim_stats.h"
+
+// Simulator kernels that live outside simulate.c. Like the ones in
+// simulate.c, they read the current spheres from spheres[0, n_spheres) and
+// write results into the second half of the array, spheres[n_spheres, 2 *
+// n_spheres).
+
+// Contributions of one sphere to the energy and momentum totals. The
+// potential term covers the pairs (i, j) with j > i, so every pair is
+// counted once.
+typedef struct {
+  double potential;
+  double kinetic;
+  double px, py, pz;
+} diag_row_t;
+
+// Check if the spheres at indices i and j collide in the next
+// timeToCollision timesteps
+// 
+// If so, modifies timeToCollision to be the time until spheres i and j collide.
+inline __attribute__((always_inline))
+static int check_for_collision(const sphere_t *spheres, int i, int j, float *timeToCollision, scan_counts_t *counts) {
+  SIM_STATS_COUNT(counts, calls);
+  vector_t distVec = qsubtract(spheres[i].pos, spheres[j].pos);
+  float dist = qsize(distVec);
+  float sumRadii = (float)((double)spheres[i].r + (double)spheres[j].r);
+
+  // Shift frame of reference to act like sphere i is stationary
+  // Not adjusting for acceleration because our simulation does not adjust for acceleration
+  vector_t movevec = qsubtract(spheres[j].vel, spheres[i].vel);
+
+  // Distance that sphere j moves in timeToCollision time
+  float moveDist = (float)((double)qsize(movevec) * (double)*timeToCollision);
+
+  // Break if the length the sphere moves in timeToCollision time is less than
+  // distance between the centers of these spheres minus their radii
+  if ((double)moveDist < (double)dist - (double)sumRadii ||
+      (movevec.x == 0 && movevec.y == 0 && movevec.z == 0)) {
+    SIM_STATS_COUNT(counts, early_rejects);
+    return 0;
+  }
+
+  vector_t unitMovevec = scale(1 / qsize(movevec), movevec);
+
+  // distAlongMovevec = ||distVec|| * cos(angle between unitMovevec and distVec)
+  float distAlongMovevec = qdot(unitMovevec, distVec);
+
+  // Check that sphere j is moving towards sphere i
+  if (distAlongMovevec <= 0) {
+    return 0;
+  }
+
+  float jToMovevecDistSq =
+      (float)((double)(dist * dist) -
+              (double)(distAlongMovevec * distAlongMovevec));
+
+  // Break if the closest that sphere j will get to sphere i is more than
+  // the sum of their radii
+  float sumRadiiSquared = sumRadii * sumRadii;
+  if (jToMovevecDistSq >= sumRadiiSquared) {
+    return 0;
+  }
+
+  // We now have jToMovevecDistSq and sumRadii, two sides of a right triangle.
+  // Use these to find the third side, sqrt(T)
+  float extraDist = (float)((double)sumRadiiSquared - (double)jToMovevecDistSq);
+
+  // Draw out the spheres to check why this is the distance sphere j moves
+  // before hitting sphere i;)
+  float distance = (float)((double)distAlongMovevec - (double)sqrt(extraDist));
+
+  // Break if the distance sphere j has to move to touch sphere i is too big
+  if (distance < 0 || moveDist < distance) {
+    return 0;
+  }
+
+  *timeToCollision = distance / qsize(movevec);
+  return 1;
+}
+
+// Sweeps sphere i against spheres others[0, count), in that order, with the
+// same outcome as calling check_for_collision on each pair: lowers
+// *timeToCollision to the earliest collision found and sets *collideWith to
+// its partner, or leaves both alone if there is none. Returns whether any
+// collision was found.
+//
+// Blocks of candidates first go through a vectorized, deliberately loose
+// version of check_for_collision's first test, and only the pairs that
+// might pass it get the exact check.
+int sweep_collisions(const sphere_t *spheres, int i, const int *others, int count,
+                     float *timeToCollision, int *collideWith, scan_counts_t *counts);
+
+// Same as sweep_collisions, for the spheres [lo, hi) other than i.
+int sweep_collision_range(const sphere_t *spheres, int i, int lo, int hi,
+                          float *timeToCollision, int *collideWith, scan_counts_t *counts);
+
+// Structure-of-arrays copy of the sphere data the fast gravity kernel
+// reads, padded to a multiple of the vector width.
+typedef struct {
+  int capacity;
+  float *x, *y, *z;
+  // g * mass of each sphere; zero in the padding.
+  float *gm;
+} fast_scratch_t;
+
+int fast_scratch_init(fast_scratch_t *scratch, int n_spheres);
+
+void fast_scratch_destroy(fast_scratch_t *scratch);
+
+// SIM_PRECISION_FAST counterpart of update_accelerations.
+void update_accelerations_fast(sphere_t *spheres, int n_spheres, double g,
+                               fast_scratch_t *scratch, diag_row_t *diag_rows);
+
+// SIM_PRECISION_FAST counterpart of update_velocities_and_positions.
+void update_velocities_and_positions_fast(sphere_t *spheres, int n_spheres, float t);
+
+// Scenes with at most this many spheres run on the serial kernels below,
+// where spawning and heap allocation would cost more than the work itself.
+#define SIM_SMALL_MAX 64
+// Up to this many spheres every kernel is compiled for the exact count, so
+// its loops are fully unrolled.
+#define SIM_SMALL_UNROLL_MAX 16
+
+// Serial, allocation-free kernels for one small sphere count. Each one
+// reproduces its generic counterpart bit-for-bit.
+typedef struct {
+  // Same as update_accelerations.
+  void (*update_accelerations)(sphere_t *spheres, int n_spheres, double g, diag_row_t *diag_rows);
+  // Same as update_velocities_and_positions.
+  void (*integrate)(sphere_t *spheres, int n_spheres, float t);
+  // Frame-start collision table: for each i, the earliest collision within
+  // timeStep with some j > i.
+  void (*scan)(const sphere_t *spheres, int n_spheres, float timeStep, float *collisionTimes,
+               int *collideWith, scan_counts_t *counts);
+  // Earliest collision of sphere i with any other sphere within
+  // collisionTimes[i].
+  void (*rescan)(const sphere_t *spheres, int n_spheres, int i, float *collisionTimes,
+                 int *collideWith, scan_counts_t *counts);
+} small_kernels_t;
+
+// The kernels specialized for n_spheres, or NULL if n_spheres is larger
+// than SIM_SMALL_MAX.
+const small_kernels_t *small_kernels_for(int n_spheres);
+
+#endif // SIM_KERNELS_H
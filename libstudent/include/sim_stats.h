@@ -0,0 +1,70 @@
+#ifndef SIM_STATS_H
+#define SIM_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "./simulate_ext.h"
+
+// Instrumentation hooks for the simulator. Build with `make SIM_STATS=1` to
+// turn them on; otherwise every macro below expands to nothing, so the hot
+// loops are compiled exactly as if the hooks were not there.
+
+#ifndef SIM_STATS
+#define SIM_STATS 0
+#endif
+
+// Per-call-site counters for check_for_collision. Scan loops keep one of
+// these on the stack and fold it into the simulator totals once, so the
+// inner loops never touch shared memory.
+typedef struct {
+  uint64_t calls;
+  uint64_t early_rejects;
+} scan_counts_t;
+
+#if SIM_STATS
+
+inline __attribute__((always_inline))
+static uint64_t sim_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#define SIM_STATS_ADD(stats, field, v) \
+  __atomic_fetch_add(&(stats)->field, (uint64_t)(v), __ATOMIC_RELAXED)
+#define SIM_STATS_COUNT(counts, field) ((counts)->field++)
+#define SIM_STATS_FLUSH(stats, counts)                               \
+  do {                                                               \
+    SIM_STATS_ADD(stats, collision_checks, (counts)->calls);         \
+    SIM_STATS_ADD(stats, early_rejects, (counts)->early_rejects);    \
+  } while (0)
+#define SIM_STATS_TIMER_START(name) uint64_t name = sim_stats_now()
+#define SIM_STATS_TIMER_STOP(stats, phase, name) \
+  SIM_STATS_ADD(stats, phase_ns[phase], sim_stats_now() - (name))
+#define SIM_STATS_ONLY(...) __VA_ARGS__
+
+// Account for one finished frame that took `ministeps` ministeps.
+inline __attribute__((always_inline))
+static void sim_stats_record_frame(sim_stats_t *stats, uint64_t ministeps) {
+  int bucket = 0;
+  while (bucket < SIM_STATS_HIST_BUCKETS - 1 && (ministeps >> (bucket + 1)) != 0) {
+    bucket++;
+  }
+  SIM_STATS_ADD(stats, frames, 1);
+  SIM_STATS_ADD(stats, ministeps, ministeps);
+  SIM_STATS_ADD(stats, ministep_hist[bucket], 1);
+}
+
+#else
+
+#define SIM_STATS_ADD(stats, field, v) ((void)(stats))
+#define SIM_STATS_COUNT(counts, field) ((void)(counts))
+#define SIM_STATS_FLUSH(stats, counts) ((void)(stats), (void)(counts))
+#define SIM_STATS_TIMER_START(name) ((void)0)
+#define SIM_STATS_TIMER_STOP(stats, phase, name) ((void)(stats))
+#define SIM_STATS_ONLY(...)
+
+#endif // SIM_STATS
+
+#endif // SIM_STATS_H
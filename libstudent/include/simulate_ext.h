@@ -0,0 +1,301 @@
+#ifndef SIMULATE_EXT_H
+#define SIMULATE_EXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../common/simulate.h"
+
+// Extensions to the simulator API in common/simulate.h. These are only
+// provided by libstudent, so only callers that link libstudent directly
+// (find-tier, ref-tester, gen_eframes) may use them.
+
+// Number of buckets in the ministeps-per-frame histogram. Bucket k counts
+// frames that took between 2^k and 2^(k+1) - 1 ministeps; the last bucket
+// also holds everything above that.
+#define SIM_STATS_HIST_BUCKETS 16
+
+typedef enum {
+  SIM_PHASE_SCAN,      // frame-start collision table
+  SIM_PHASE_SELECT,    // picking the next collision and advancing the table
+  SIM_PHASE_FORCE,     // gravity pass
+  SIM_PHASE_INTEGRATE, // velocity/position update and collision response
+  SIM_PHASE_RESCAN,    // rescans after a collision
+  SIM_N_PHASES,
+} sim_phase_e;
+
+/**
+ * @brief Counters collected by the simulator since init (or the last reset).
+ *
+ * Counters are only maintained when libstudent is built with SIM_STATS=1;
+ * otherwise every counter reads as zero and `enabled` is false.
+ */
+typedef struct {
+  bool enabled;
+
+  uint64_t frames;
+  uint64_t ministeps;
+  // Ministeps that ended in a collision between two spheres.
+  uint64_t collisions;
+  // Calls to check_for_collision, and how many of those returned from the
+  // first (distance vs. movement) test.
+  uint64_t collision_checks;
+  uint64_t early_rejects;
+  // Spheres whose persisted collision candidates had to be recomputed
+  // because they moved too far since the last time.
+  uint64_t candidate_refreshes;
+
+  uint64_t ministep_hist[SIM_STATS_HIST_BUCKETS];
+  uint64_t phase_ns[SIM_N_PHASES];
+} sim_stats_t;
+
+EXPORT
+/**
+ * @brief Return a snapshot of the counters collected by state.
+ */
+sim_stats_t simulator_stats(const struct simulator_state *state);
+
+EXPORT
+/**
+ * @brief Zero all counters collected by state.
+ */
+void simulator_reset_stats(struct simulator_state *state);
+
+EXPORT
+/**
+ * @brief Return a short human-readable name for phase.
+ */
+const char *sim_phase_name(sim_phase_e phase);
+
+/**
+ * @brief Energy and momentum of the simulated system.
+ *
+ * These are accumulated inside the first gravity pass of each frame rather
+ * than in a separate pass over the pairs, so after the k-th call to
+ * simulate() (counting from 0) they describe the spheres as they were when
+ * that call started: the initial spec for k = 0, the result of call k - 1
+ * otherwise.
+ */
+typedef struct {
+  // False until a frame has run with diagnostics enabled.
+  bool valid;
+  // The simulate() call these were collected in, from 0.
+  uint64_t frame;
+  double kinetic;
+  // Gravitational potential energy, -g * sum over pairs of m_i * m_j / r_ij.
+  double potential;
+  double total;
+  double momentum[3];
+} sim_diagnostics_t;
+
+EXPORT
+/**
+ * @brief Turn the energy/momentum diagnostics on or off for state. They
+ * are off after init_simulator.
+ *
+ * @return 0 on success, nonzero if the scratch space could not be allocated
+ */
+int simulator_enable_diagnostics(struct simulator_state *state, bool enable);
+
+EXPORT
+/**
+ * @brief Return the diagnostics collected by the most recent simulate()
+ * call that ran with them enabled.
+ */
+sim_diagnostics_t simulator_diagnostics(const struct simulator_state *state);
+
+typedef enum {
+  // Matches the staff reference bit-for-bit: every vector operation rounds
+  // through double exactly like misc_utils.h.
+  SIM_PRECISION_EXACT,
+  // Native single precision with FMA, vectorized gravity and rsqrt plus a
+  // Newton step instead of sqrt and divide. Faster, but drifts from the
+  // reference; see simulator_precision_report.
+  SIM_PRECISION_FAST,
+} sim_precision_e;
+
+EXPORT
+/**
+ * @brief Switch state to the given precision from the next simulate() call
+ * on. New simulators start in SIM_PRECISION_EXACT unless libstudent was
+ * built with SIM_FAST_MATH=1.
+ *
+ * @return 0 on success, nonzero if the fast mode's scratch space could not
+ * be allocated (state is left unchanged)
+ */
+int simulator_set_precision(struct simulator_state *state, sim_precision_e precision);
+
+EXPORT
+/**
+ * @brief Return the precision state currently simulates in.
+ */
+sim_precision_e simulator_precision(const struct simulator_state *state);
+
+/**
+ * @brief How far SIM_PRECISION_FAST drifted from SIM_PRECISION_EXACT after
+ * one frame.
+ */
+typedef struct {
+  // Largest and root-mean-square distance between a sphere's exact and
+  // fast positions.
+  double max_pos_error;
+  double rms_pos_error;
+  // Largest velocity difference relative to the exact speed.
+  double max_rel_vel_error;
+  // Diagonal of the exact spheres' bounding box, to put the errors in scale.
+  double scene_extent;
+} sim_precision_error_t;
+
+EXPORT
+/**
+ * @brief Run spec for n_frames frames in both precisions side by side and
+ * record how far apart they are after each frame.
+ *
+ * @param[out] errors array of at least n_frames entries
+ * @return 0 on success, nonzero if a simulator could not be set up
+ */
+int simulator_precision_report(const simulator_spec_t *spec, int n_frames,
+                               sim_precision_error_t *errors);
+
+/**
+ * @brief Settings for the experimental Parareal mode.
+ *
+ * In Parareal mode the simulator works a window of frames ahead at a time.
+ * A cheap coarse propagator (one single-precision gravity pass and Euler
+ * step per frame, with no collisions) predicts the whole window, then full
+ * simulate() frames started from every prediction run in parallel and
+ * correct it, iterating until the window settles.
+ */
+typedef struct {
+  // Frames worked on at a time; at least 1.
+  int window;
+  // Correction rounds per window; at least 1.
+  int max_iterations;
+  // A window is taken once a round moves no sphere by more than this
+  // fraction of the scene's extent. With 0, only the frames that provably
+  // match sequential simulation are taken, which is exact but rarely
+  // faster.
+  double tolerance;
+} sim_parareal_options_t;
+
+typedef struct {
+  uint64_t windows;
+  uint64_t iterations;
+  // Frames handed out from Parareal windows.
+  uint64_t frames_accepted;
+  // Windows cut short because a fine frame had a collision, after which
+  // the simulator runs one window's worth of frames sequentially.
+  uint64_t fallbacks;
+} sim_parareal_stats_t;
+
+EXPORT
+/**
+ * @brief Turn Parareal mode on with the given options, or off if options
+ * is NULL.
+ *
+ * With a nonzero tolerance the frames no longer match the reference.
+ * Frames handed out from a window do not update the diagnostics or the
+ * event log; frames the simulator falls back to sequential mode for do.
+ *
+ * @return 0 on success, nonzero if the options are invalid or the
+ * scratch space could not be allocated (state is left unchanged)
+ */
+int simulator_enable_parareal(struct simulator_state *state, const sim_parareal_options_t *options);
+
+EXPORT
+/**
+ * @brief Return what Parareal mode has done since it was turned on.
+ */
+sim_parareal_stats_t simulator_parareal_stats(const struct simulator_state *state);
+
+/**
+ * @brief Settings for the experimental out-of-core mode.
+ *
+ * An out-of-core simulator keeps its spheres in a memory-mapped scratch
+ * file instead of the heap, grouped into chunks of nearby spheres that
+ * each pass streams through in order, so scenes larger than memory only
+ * cost page cache. Gravity from distant chunks is taken from their centre
+ * of mass, and collisions are resolved pair by pair with every sphere
+ * keeping its own clock, so frames do not match the reference.
+ *
+ * Collisions are searched for in the chunks next to each sphere, whose
+ * size fits all but the 64 spheres that can travel or reach furthest in a
+ * frame. Those few are checked against everything nearby instead, but
+ * scenes where many spheres are much larger or faster than the rest get
+ * crowded chunks and slow frames.
+ */
+typedef struct {
+  // Directory for the scratch file; NULL uses $TMPDIR, or /tmp without
+  // it. The file is unlinked as soon as it is mapped.
+  const char *dir;
+  // A chunk (or group of chunks) whose side is less than this fraction of
+  // its distance to a sphere acts on that sphere through its centre of
+  // mass; 0 sums every pair exactly. Must not be negative.
+  double opening_angle;
+} sim_out_of_core_options_t;
+
+EXPORT
+/**
+ * @brief Like init_simulator, but for the out-of-core mode with the given
+ * options, or the defaults if options is NULL.
+ *
+ * The array simulate() returns lives in the scratch file; simulate()
+ * returns NULL instead if a frame's collision events could not be
+ * allocated. Out-of-core simulators ignore the precision setting and
+ * collect no stats, diagnostics or event log entries, and cannot run in
+ * Parareal mode.
+ *
+ * @return the new simulator, or NULL if options are invalid or the scratch
+ * file could not be set up
+ */
+struct simulator_state *init_simulator_out_of_core(const simulator_spec_t *spec,
+                                                   const sim_out_of_core_options_t *options);
+
+// Collision event logs are binary files holding a collision_log_header_t
+// followed by one collision_event_t per resolved collision, in the order
+// the simulator resolved them. All fields are in host byte order.
+
+#define COLLISION_LOG_MAGIC "SPHCLOG"
+#define COLLISION_LOG_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  // sizeof(collision_event_t), so readers can detect layout changes.
+  uint32_t record_size;
+  // Events that were lost because the ring was full. Written on close.
+  uint64_t dropped;
+} collision_log_header_t;
+
+typedef struct {
+  // Index of the simulate() call the collision happened in, from 0.
+  uint64_t frame;
+  // Time since the start of that frame.
+  float time;
+  // The colliding spheres, as indices into the simulator's sphere array.
+  int32_t i, j;
+  // Change in momentum of sphere i; sphere j receives the opposite impulse.
+  vector_t impulse;
+} collision_event_t;
+
+EXPORT
+/**
+ * @brief Start publishing every collision state resolves to the file at
+ * path. Events are queued in a lock-free ring with room for at least
+ * capacity events (0 picks a default) and written out by a background
+ * thread; destroy_simulator flushes and closes the file.
+ *
+ * @return 0 on success, nonzero if the file or thread could not be created
+ */
+int simulator_open_event_log(struct simulator_state *state, const char *path,
+                             size_t capacity);
+
+EXPORT
+/**
+ * @brief Return how many events state's log dropped because its ring was
+ * full, or 0 if no log is open.
+ */
+uint64_t simulator_event_log_dropped(const struct simulator_state *state);
+
+#endif // SIMULATE_EXT_H
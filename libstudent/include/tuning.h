@@ -0,0 +1,108 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdbool.h>
+
+#include "../../common/simulate.h" // EXPORT
+
+// Grain sizes for the cilk_for loops in libstudent.
+//
+// Every tuned loop runs over [0, n) in blocks of tuning_grain(loop, n)
+// iterations, one block per strand. Grains are kept per loop and per
+// problem-size bucket, where bucket b holds sizes in [2^b, 2^(b+1)), so a
+// 15-sphere scene and an 18,000-sphere scene can use different values.
+// Buckets nobody has tuned fall back to the same heuristic cilk_for uses
+// by default.
+
+typedef enum {
+  TUNE_SIM_SCAN,           // frame-start collision table, per sphere
+  TUNE_SIM_FORCE,          // gravity pair blocks, block side in spheres
+  TUNE_SIM_ACCUMULATE,     // writing out the summed terms, per sphere
+  TUNE_SIM_INTEGRATE,      // velocity/position update, per sphere
+  TUNE_SIM_SELECT,         // next-event search over the collision table
+  TUNE_RENDER_CULL,        // culling and depth keys, per sphere
+  TUNE_RENDER_SORT_PASS,   // radix sort passes, per sphere
+  TUNE_RENDER_SORT_REPAIR, // repairing the previous order, per sphere
+  TUNE_RENDER_SCATTER,     // moving spheres into sorted order, per sphere
+  TUNE_RENDER_BOUNDS,      // screen-space bounding boxes, per sphere
+  TUNE_RENDER_RAYS,        // primary rays, per image row
+  TUNE_RENDER_TRACE,       // BVH traversal, per image row
+  TUNE_RENDER_BIN,         // binning spheres into tiles, per row of tiles
+  TUNE_RENDER_TILES,       // drawing the tiles, per tile of average cost
+  TUNE_N_LOOPS,
+} tune_loop_e;
+
+#define TUNE_N_BUCKETS 32
+
+/**
+ * @brief Return the grain to run loop with over n iterations; always at
+ * least 1.
+ */
+int tuning_grain(tune_loop_e loop, int n);
+
+// A loop body calibration can run on its own. It must leave its inputs
+// unchanged, so it can be repeated.
+typedef void (*tuning_body_t)(void *arg);
+
+/**
+ * @brief If calibration is on and loop's bucket for n has not been tuned
+ * yet, time body with a range of grains and keep the fastest.
+ */
+void tuning_calibrate(tune_loop_e loop, int n, tuning_body_t body, void *arg);
+
+/**
+ * @brief Like tuning_calibrate, for loops that clamp their grain to
+ * max_grain: no candidate above it is tried, since those would all run
+ * the same way.
+ */
+void tuning_calibrate_max(tune_loop_e loop, int n, int max_grain, tuning_body_t body, void *arg);
+
+EXPORT
+/**
+ * @brief Turn calibration on or off. While it is on, init_simulator and
+ * the first render() of each renderer time their loops and fill in any
+ * bucket that has not been tuned yet. It is off by default.
+ */
+void tuning_set_calibrate(bool enable);
+
+EXPORT
+/**
+ * @brief Whether calibration is on.
+ */
+bool tuning_calibrating(void);
+
+EXPORT
+/**
+ * @brief Return a short name for loop, as used in tuning files.
+ */
+const char *tuning_loop_name(tune_loop_e loop);
+
+EXPORT
+/**
+ * @brief Load grains from the tuning file at path, on top of the ones
+ * already set.
+ *
+ * Tuning files are plain text with one `<loop name> <min size> <grain>`
+ * line per tuned bucket, where min size is the power of two the bucket
+ * starts at. Lines starting with '#' are ignored.
+ *
+ * @return 0 on success, nonzero if the file could not be read or is
+ * malformed
+ */
+int tuning_load(const char *path);
+
+EXPORT
+/**
+ * @brief Write every tuned bucket to path in the format tuning_load reads.
+ *
+ * @return 0 on success, nonzero if the file could not be written
+ */
+int tuning_save(const char *path);
+
+EXPORT
+/**
+ * @brief Forget every tuned grain.
+ */
+void tuning_reset(void);
+
+#endif // TUNING_H
@@ -0,0 +1,305 @@
+#include "../include/candidates.h"
+#include "../include/misc_utils.h"
+
+#include <cilk/cilk.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Slack on top of the skin for the rounding in check_for_collision, which
+// works in single precision: a pair is only dropped if its gap clears the
+// skin by this fraction of the lengths involved.
+#define CANDIDATE_REL_MARGIN 1e-5
+
+// Frames of travel the skin allows for; the drift budget is half of it.
+#define CANDIDATE_SKIN_FRAMES 4
+
+// Rebuild every list instead of refreshing spheres one by one once more
+// than 1 / CANDIDATE_REBUILD_FRACTION of them went stale.
+#define CANDIDATE_REBUILD_FRACTION 8
+
+// With the grid, a rebuild costs about this many pair tests per sphere and
+// per listed pair, so refreshing stale spheres at n tests each stops paying
+// off well before the fraction above is reached in large scenes.
+#define CANDIDATE_GRID_REBUILD_COST 8
+
+int candidates_init(candidate_set_t *c, int n_spheres) {
+  memset(c, 0, sizeof(*c));
+  c->n_spheres = n_spheres;
+  c->ref_pos = malloc((size_t)n_spheres * sizeof(vector_t));
+  c->ref_vel = malloc((size_t)n_spheres * sizeof(vector_t));
+  c->lists = calloc((size_t)n_spheres, sizeof(candidate_list_t));
+  c->stale = malloc((size_t)n_spheres * sizeof(int));
+  c->is_stale = malloc((size_t)n_spheres * sizeof(bool));
+  if (n_spheres > 0 && (c->ref_pos == NULL || c->ref_vel == NULL || c->lists == NULL ||
+                        c->stale == NULL || c->is_stale == NULL)) {
+    candidates_destroy(c);
+    return 1;
+  }
+  c->reach = malloc((size_t)n_spheres * sizeof(double));
+  c->use_grid = (n_spheres == 0 || c->reach != NULL) && hgrid_init(&c->grid, n_spheres) == 0;
+  return 0;
+}
+
+void candidates_destroy(candidate_set_t *c) {
+  if (c->lists != NULL) {
+    for (int i = 0; i < c->n_spheres; i++) {
+      free(c->lists[i].adj);
+    }
+  }
+  free(c->ref_pos);
+  free(c->ref_vel);
+  free(c->lists);
+  free(c->stale);
+  free(c->is_stale);
+  if (c->use_grid) {
+    hgrid_destroy(&c->grid);
+  }
+  free(c->reach);
+  memset(c, 0, sizeof(*c));
+}
+
+static double vlen(double x, double y, double z) {
+  return sqrt(x * x + y * y + z * z);
+}
+
+// Whether spheres i and j, as of their reference states, are close enough
+// that they might pass check_for_collision's first test before either one
+// drifts out of its budget. Symmetric in i and j.
+static bool may_collide(const candidate_set_t *c, const sphere_t *spheres, int i, int j) {
+  vector_t pi = c->ref_pos[i], pj = c->ref_pos[j];
+  vector_t vi = c->ref_vel[i], vj = c->ref_vel[j];
+  double dist = vlen((double)pi.x - pj.x, (double)pi.y - pj.y, (double)pi.z - pj.z);
+  double move = (double)c->horizon * vlen((double)vi.x - vj.x, (double)vi.y - vj.y, (double)vi.z - vj.z);
+  double sum_r = (double)spheres[i].r + spheres[j].r;
+  double gap = dist - sum_r - move;
+  double slack = c->skin + CANDIDATE_REL_MARGIN * (dist + sum_r + move + c->skin);
+  // Written so that NaNs keep the pair.
+  return !(gap > slack);
+}
+
+// Appends j to list. Returns false, leaving the list as it was and marking
+// it failed, if it could not grow.
+static bool list_push(candidate_list_t *list, int j) {
+  if (list->deg == list->cap) {
+    int cap = list->cap > 0 ? 2 * list->cap : 8;
+    int *adj = realloc(list->adj, (size_t)cap * sizeof(int));
+    if (adj == NULL) {
+      list->failed = true;
+      return false;
+    }
+    list->adj = adj;
+    list->cap = cap;
+  }
+  list->adj[list->deg++] = j;
+  return true;
+}
+
+int candidate_list_find(const candidate_list_t *list, int j) {
+  int lo = 0, hi = list->deg;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (list->adj[mid] < j) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void list_set(candidate_list_t *list, int j, bool member) {
+  int at = candidate_list_find(list, j);
+  bool present = at < list->deg && list->adj[at] == j;
+  if (member && !present) {
+    if (!list_push(list, j)) {
+      return;
+    }
+    memmove(&list->adj[at + 1], &list->adj[at], (size_t)(list->deg - 1 - at) * sizeof(int));
+    list->adj[at] = j;
+  } else if (!member && present) {
+    memmove(&list->adj[at], &list->adj[at + 1], (size_t)(list->deg - 1 - at) * sizeof(int));
+    list->deg--;
+  }
+}
+
+static void set_reference(candidate_set_t *c, const sphere_t *spheres, int i) {
+  c->ref_pos[i] = spheres[i].pos;
+  c->ref_vel[i] = spheres[i].vel;
+}
+
+typedef struct {
+  const candidate_set_t *c;
+  const sphere_t *spheres;
+  int i;
+  candidate_list_t *list;
+} grid_visit_t;
+
+static void visit_pair(int j, void *arg) {
+  grid_visit_t *v = arg;
+  if (may_collide(v->c, v->spheres, v->i, j)) {
+    list_push(v->list, j);
+  }
+}
+
+// Whether sphere i's own grid query covers j (see hgrid_query_up). Spheres
+// the grid left out test against everything.
+static bool grid_covers(const hgrid_t *grid, int i, int j) {
+  return grid->level[i] < 0 || (grid->level[j] >= 0 && grid->level[j] >= grid->level[i]);
+}
+
+static int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// A pair passes may_collide only if the spheres are within
+//
+//   (r_i + T |v_i| + S / 2) + (r_j + T |v_j| + S / 2)
+//
+// of each other, give or take the relative margin, so those are the reaches
+// the grid gets. Each sphere first collects the pairs its query covers;
+// the others are then copied over from the sphere on the lower level.
+static void rebuild_with_grid(candidate_set_t *c, const sphere_t *spheres) {
+  int n = c->n_spheres;
+  hgrid_t *grid = &c->grid;
+  cilk_for (int i = 0; i < n; i++) {
+    vector_t v = c->ref_vel[i];
+    c->reach[i] = (1 + 4 * CANDIDATE_REL_MARGIN) *
+                  ((double)spheres[i].r + (double)c->horizon * vlen(v.x, v.y, v.z) + 0.5 * c->skin);
+  }
+  hgrid_build(grid, c->ref_pos, c->reach);
+
+  // stale is free during rebuilds; it holds how many pairs each sphere
+  // found itself.
+  int *own_deg = c->stale;
+  cilk_for (int i = 0; i < n; i++) {
+    candidate_list_t *list = &c->lists[i];
+    list->deg = 0;
+    if (grid->level[i] < 0) {
+      for (int j = 0; j < n; j++) {
+        if (j != i && may_collide(c, spheres, i, j)) {
+          list_push(list, j);
+        }
+      }
+    } else {
+      grid_visit_t visit = {.c = c, .spheres = spheres, .i = i, .list = list};
+      hgrid_query_up(grid, i, c->ref_pos[i], visit_pair, &visit);
+    }
+    own_deg[i] = list->deg;
+  }
+  for (int j = 0; j < n; j++) {
+    for (int k = 0; k < own_deg[j]; k++) {
+      int i = c->lists[j].adj[k];
+      if (!grid_covers(grid, i, j)) {
+        list_push(&c->lists[i], j);
+      }
+    }
+  }
+  cilk_for (int i = 0; i < n; i++) {
+    // Lists that never grew have no buffer to hand to qsort.
+    if (c->lists[i].deg > 1) {
+      qsort(c->lists[i].adj, (size_t)c->lists[i].deg, sizeof(int), compare_ints);
+    }
+  }
+}
+
+static void rebuild_all(candidate_set_t *c, const sphere_t *spheres, float horizon) {
+  int n = c->n_spheres;
+  c->horizon = horizon;
+
+  // The skin trades list length against how often spheres go stale. About
+  // one radius plus a few frames' travel keeps both low for typical scenes.
+  double skin = 0;
+  for (int i = 0; i < n; i++) {
+    skin += spheres[i].r + CANDIDATE_SKIN_FRAMES * horizon * qsize(spheres[i].vel);
+  }
+  c->skin = n > 0 ? skin / n : 0;
+
+  cilk_for (int i = 0; i < n; i++) {
+    set_reference(c, spheres, i);
+  }
+  if (c->use_grid) {
+    rebuild_with_grid(c, spheres);
+  } else {
+    cilk_for (int i = 0; i < n; i++) {
+      candidate_list_t *list = &c->lists[i];
+      list->deg = 0;
+      for (int j = 0; j < n; j++) {
+        if (j != i && may_collide(c, spheres, i, j)) {
+          list_push(list, j);
+        }
+      }
+    }
+  }
+  c->n_pairs = 0;
+  for (int i = 0; i < n; i++) {
+    c->n_pairs += c->lists[i].deg;
+  }
+  c->built = true;
+}
+
+// Recomputes every pair sphere k is in, from k's current state.
+static void refresh(candidate_set_t *c, const sphere_t *spheres, int k, bool *member) {
+  int n = c->n_spheres;
+  set_reference(c, spheres, k);
+  // Each j's list only changes in whether it holds k, so they can all be
+  // fixed up at once.
+  cilk_for (int j = 0; j < n; j++) {
+    member[j] = j != k && may_collide(c, spheres, k, j);
+    if (j != k) {
+      list_set(&c->lists[j], k, member[j]);
+    }
+  }
+  candidate_list_t *list = &c->lists[k];
+  list->deg = 0;
+  for (int j = 0; j < n; j++) {
+    if (member[j]) {
+      list_push(list, j);
+    }
+  }
+}
+
+// Whether every list is complete.
+static bool lists_ok(const candidate_set_t *c) {
+  for (int i = 0; i < c->n_spheres; i++) {
+    if (c->lists[i].failed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int candidates_update(candidate_set_t *c, const sphere_t *spheres, float horizon) {
+  int n = c->n_spheres;
+  if (!c->built || horizon != c->horizon) {
+    rebuild_all(c, spheres, horizon);
+    return lists_ok(c) ? n : -1;
+  }
+
+  double budget = 0.5 * c->skin;
+  cilk_for (int i = 0; i < n; i++) {
+    vector_t p = spheres[i].pos, v = spheres[i].vel;
+    vector_t rp = c->ref_pos[i], rv = c->ref_vel[i];
+    double drift = vlen((double)p.x - rp.x, (double)p.y - rp.y, (double)p.z - rp.z) +
+                   (double)horizon * vlen((double)v.x - rv.x, (double)v.y - rv.y, (double)v.z - rv.z);
+    c->is_stale[i] = !(drift <= budget);
+  }
+  int n_stale = 0;
+  for (int i = 0; i < n; i++) {
+    if (c->is_stale[i]) {
+      c->stale[n_stale++] = i;
+    }
+  }
+
+  if (n_stale > n / CANDIDATE_REBUILD_FRACTION ||
+      (c->use_grid && (double)n_stale * n > CANDIDATE_GRID_REBUILD_COST * (double)(n + c->n_pairs))) {
+    rebuild_all(c, spheres, horizon);
+    return lists_ok(c) ? n : -1;
+  }
+  // is_stale has served its purpose, so refresh can use it as scratch.
+  for (int s = 0; s < n_stale; s++) {
+    refresh(c, spheres, c->stale[s], c->is_stale);
+  }
+  return lists_ok(c) ? n_stale : -1;
+}
@@ -0,0 +1,108 @@
+#include "../include/event_log.h"
+#include "../include/misc_utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Ring size used when the caller asks for capacity 0.
+#define EVENT_LOG_DEFAULT_CAPACITY (1u << 16)
+
+// How long the consumer sleeps when it finds the ring empty.
+#define EVENT_LOG_IDLE_NS 200000
+
+static void *event_log_consume(void *arg) {
+  event_log_t *log = arg;
+  const size_t ring_size = log->mask + 1;
+  const struct timespec idle = {.tv_sec = 0, .tv_nsec = EVENT_LOG_IDLE_NS};
+
+  for (;;) {
+    // Read `closing` before `head` so that the last pushes are visible once
+    // the producer has asked us to stop.
+    bool closing = atomic_load_explicit(&log->closing, memory_order_acquire);
+    size_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+
+    if (head == tail) {
+      if (closing) {
+        break;
+      }
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    // The pending events may wrap around the end of the ring.
+    size_t begin = tail & log->mask;
+    size_t count = head - tail;
+    size_t first = min(count, ring_size - begin);
+    fwrite(log->ring + begin, sizeof(collision_event_t), first, log->out);
+    if (count > first) {
+      fwrite(log->ring, sizeof(collision_event_t), count - first, log->out);
+    }
+    atomic_store_explicit(&log->tail, head, memory_order_release);
+  }
+  return NULL;
+}
+
+event_log_t *event_log_open(const char *path, size_t capacity) {
+  if (capacity == 0) {
+    capacity = EVENT_LOG_DEFAULT_CAPACITY;
+  }
+  size_t ring_size = 1;
+  while (ring_size < capacity) {
+    ring_size <<= 1;
+  }
+
+  event_log_t *log = aligned_alloc(EVENT_LOG_CACHE_LINE, sizeof(event_log_t));
+  if (log == NULL) {
+    return NULL;
+  }
+  memset(log, 0, sizeof(*log));
+  log->mask = ring_size - 1;
+  log->ring = malloc(ring_size * sizeof(collision_event_t));
+  log->out = fopen(path, "wb");
+  if (log->ring == NULL || log->out == NULL) {
+    goto error;
+  }
+
+  collision_log_header_t header = {
+      .magic = COLLISION_LOG_MAGIC,
+      .version = COLLISION_LOG_VERSION,
+      .record_size = sizeof(collision_event_t),
+      .dropped = 0,
+  };
+  if (fwrite(&header, sizeof(header), 1, log->out) != 1) {
+    goto error;
+  }
+
+  atomic_init(&log->head, 0);
+  atomic_init(&log->tail, 0);
+  atomic_init(&log->closing, false);
+  if (pthread_create(&log->consumer, NULL, event_log_consume, log) != 0) {
+    goto error;
+  }
+  return log;
+
+error:
+  if (log->out != NULL) {
+    fclose(log->out);
+  }
+  free(log->ring);
+  free(log);
+  return NULL;
+}
+
+void event_log_close(event_log_t *log) {
+  atomic_store_explicit(&log->closing, true, memory_order_release);
+  pthread_join(log->consumer, NULL);
+
+  // Now that every event is on disk, record how many never made it there.
+  fseek(log->out, offsetof(collision_log_header_t, dropped), SEEK_SET);
+  fwrite(&log->dropped, sizeof(log->dropped), 1, log->out);
+  fclose(log->out);
+
+  free(log->ring);
+  free(log);
+}
@@ -0,0 +1,167 @@
+#include "../include/hgrid.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Levels beyond this would only be needed for scenes whose reaches span
+// more than 2^31 to 1; the smallest points then share level 0 with points
+// somewhat larger than themselves.
+#define HGRID_MAX_LEVELS 32
+
+// Cells are sized with this much room to spare, so that rounding in the
+// cell coordinates can never move two points in reach of each other more
+// than one cell apart.
+#define HGRID_SLACK 1.001
+
+// Points further out than this many cells from the origin are left out, so
+// cell coordinates stay exact in a double.
+#define HGRID_MAX_COORD 1e12
+
+int hgrid_init(hgrid_t *grid, int n_points) {
+  memset(grid, 0, sizeof(*grid));
+  grid->n_points = n_points;
+  grid->cells_cap = 16;
+  while (grid->cells_cap < 2 * n_points) {
+    grid->cells_cap *= 2;
+  }
+  grid->level = malloc((size_t)n_points * sizeof(int));
+  grid->order = malloc((size_t)n_points * sizeof(int));
+  grid->cells = malloc((size_t)grid->cells_cap * sizeof(hgrid_cell_t));
+  if ((n_points > 0 && (grid->level == NULL || grid->order == NULL)) || grid->cells == NULL) {
+    hgrid_destroy(grid);
+    return 1;
+  }
+  return 0;
+}
+
+void hgrid_destroy(hgrid_t *grid) {
+  free(grid->level);
+  free(grid->order);
+  free(grid->cells);
+  memset(grid, 0, sizeof(*grid));
+}
+
+static uint64_t cell_hash(int level, int64_t x, int64_t y, int64_t z) {
+  uint64_t h = (uint64_t)level * 0x9e3779b97f4a7c15ull;
+  h = (h ^ (uint64_t)x) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (uint64_t)y) * 0x94d049bb133111ebull;
+  h = (h ^ (uint64_t)z) * 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 31);
+}
+
+// Slot holding the given cell, or the empty slot it would go in.
+static int find_slot(const hgrid_t *grid, int level, int64_t x, int64_t y, int64_t z) {
+  int mask = grid->cells_cap - 1;
+  int slot = (int)(cell_hash(level, x, y, z) & (uint64_t)mask);
+  while (true) {
+    const hgrid_cell_t *cell = &grid->cells[slot];
+    if (cell->count == 0 ||
+        (cell->level == level && cell->x == x && cell->y == y && cell->z == z)) {
+      return slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+static double cell_size(const hgrid_t *grid, int level) {
+  return ldexp(grid->base, level);
+}
+
+// Coordinates of the cell holding p on level; false if they are out of
+// range.
+static bool cell_of(const hgrid_t *grid, int level, vector_t p, int64_t *x, int64_t *y, int64_t *z) {
+  double size = cell_size(grid, level);
+  double cx = floor(p.x / size), cy = floor(p.y / size), cz = floor(p.z / size);
+  // Written so that NaNs fail.
+  if (!(fabs(cx) < HGRID_MAX_COORD && fabs(cy) < HGRID_MAX_COORD && fabs(cz) < HGRID_MAX_COORD)) {
+    return false;
+  }
+  *x = (int64_t)cx;
+  *y = (int64_t)cy;
+  *z = (int64_t)cz;
+  return true;
+}
+
+void hgrid_build(hgrid_t *grid, const vector_t *pos, const double *reach) {
+  int n = grid->n_points;
+
+  // Level 0 fits the smallest points, unless that would take too many
+  // levels to reach the largest.
+  double smallest = INFINITY, largest = 0;
+  for (int i = 0; i < n; i++) {
+    double need = 2 * HGRID_SLACK * reach[i];
+    if (isfinite(need) && need > 0) {
+      smallest = fmin(smallest, need);
+      largest = fmax(largest, need);
+    }
+  }
+  grid->base = largest > 0 ? fmax(smallest, ldexp(largest, -(HGRID_MAX_LEVELS - 1))) : 1;
+  grid->n_levels = 0;
+
+  for (int s = 0; s < grid->cells_cap; s++) {
+    grid->cells[s].count = 0;
+  }
+  for (int i = 0; i < n; i++) {
+    double need = 2 * HGRID_SLACK * reach[i];
+    int level = 0;
+    while (level < HGRID_MAX_LEVELS && cell_size(grid, level) < need) {
+      level++;
+    }
+    int64_t x, y, z;
+    if (!(need >= 0) || level == HGRID_MAX_LEVELS || !cell_of(grid, level, pos[i], &x, &y, &z)) {
+      grid->level[i] = -1;
+      continue;
+    }
+    grid->level[i] = level;
+    if (level >= grid->n_levels) {
+      grid->n_levels = level + 1;
+    }
+    int slot = find_slot(grid, level, x, y, z);
+    hgrid_cell_t *cell = &grid->cells[slot];
+    if (cell->count == 0) {
+      *cell = (hgrid_cell_t){.level = level, .x = x, .y = y, .z = z};
+    }
+    cell->count++;
+  }
+
+  // Each cell's range ends where the next one's starts; filling the ranges
+  // from the back in descending index order leaves every cell's points in
+  // ascending order.
+  int end = 0;
+  for (int s = 0; s < grid->cells_cap; s++) {
+    end += grid->cells[s].count;
+    grid->cells[s].start = end;
+  }
+  for (int i = n - 1; i >= 0; i--) {
+    int64_t x, y, z;
+    // The first pass only placed spheres whose cell it could work out.
+    if (grid->level[i] < 0 || !cell_of(grid, grid->level[i], pos[i], &x, &y, &z)) {
+      continue;
+    }
+    hgrid_cell_t *cell = &grid->cells[find_slot(grid, grid->level[i], x, y, z)];
+    grid->order[--cell->start] = i;
+  }
+}
+
+void hgrid_query_up(const hgrid_t *grid, int i, vector_t pos, hgrid_visit_t visit, void *arg) {
+  for (int level = grid->level[i]; level < grid->n_levels; level++) {
+    int64_t x, y, z;
+    if (!cell_of(grid, level, pos, &x, &y, &z)) {
+      continue;
+    }
+    for (int dx = -1; dx <= 1; dx++) {
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dz = -1; dz <= 1; dz++) {
+          const hgrid_cell_t *cell = &grid->cells[find_slot(grid, level, x + dx, y + dy, z + dz)];
+          for (int k = cell->start; k < cell->start + cell->count; k++) {
+            if (grid->order[k] != i) {
+              visit(grid->order[k], arg);
+            }
+          }
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,709 @@
+#include "../include/out_of_core.h"
+
+#include <cilk/cilk.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../include/misc_utils.h"
+#include "../include/sim_kernels.h"
+
+// The chunks are the cells of a grid with up to 2^OOC_MAX_GRID_BITS cells
+// per axis over the spheres' bounding cube, numbered in Morton order so
+// that the cells of every octree node are consecutive. Keys fit in 32 bits,
+// and no int count of spheres fills a finer grid at OOC_MIN_CELL_SPHERES
+// per cell.
+#define OOC_MAX_GRID_BITS 9
+
+// The grid is never made so fine that cells hold fewer spheres than this on
+// average.
+#define OOC_MIN_CELL_SPHERES 64
+
+// The grid is sized for every sphere but the OOC_MAX_LARGE that reach
+// furthest in a frame, so that one big or fast sphere cannot make it
+// coarse. Those few search as many cells around them as they need, and
+// everyone else checks them directly.
+#define OOC_MAX_LARGE 64
+
+// Reaches are counted in power-of-two bins, 2^-32 and below in the first
+// and 2^31 and up in the last, to find the ones to leave out.
+#define OOC_REACH_BINS 64
+
+#define OOC_DEFAULT_OPENING_ANGLE 0.5
+
+// Cells are sized with this much room to spare over the distance two
+// spheres can close in a frame, as in hgrid.c.
+#define OOC_SLACK 1.001
+
+// Streaming passes work on blocks of this many spheres.
+#define OOC_BLOCK (1 << 16)
+
+// Mass and mass-weighted position sums of the spheres under an octree node.
+typedef struct {
+  double mass;
+  double x, y, z;
+} ooc_node_t;
+
+// A predicted collision of spheres i and j, which only still holds if
+// neither sphere has collided since, i.e. their versions are unchanged.
+typedef struct {
+  float time;
+  int i, j;
+  uint32_t version_i, version_j;
+} ooc_event_t;
+
+// Bounds of the current spheres, and a histogram of how far apart two of
+// them can be while still able to meet within a frame: count[b] spheres
+// reach into bin b, the furthest of them max[b].
+typedef struct {
+  double lo[3], hi[3];
+  int count[OOC_REACH_BINS];
+  double max[OOC_REACH_BINS];
+} ooc_extent_t;
+
+// A sphere too large for the grid, in work slot slot, whose collisions may
+// be up to span cells away.
+typedef struct {
+  int slot;
+  int span;
+} ooc_large_t;
+
+struct out_of_core {
+  int n_spheres;
+  double g;
+  float time_step;
+  double opening_angle;
+
+  // The scratch file mapping and the per-sphere arrays carved out of it.
+  char *map;
+  size_t map_bytes;
+  // Original order; what simulate() hands out.
+  sphere_t *out;
+  // Grouped by cell, with a second copy to regroup into.
+  sphere_t *work, *work_next;
+  // Original index of each sphere in work order.
+  int *index, *index_next;
+  // The rest are in work order.
+  vector_t *next_accel;
+  // How far into the frame each sphere has been advanced, and how many
+  // collisions it has had in it.
+  float *clock;
+  uint32_t *version;
+  float *event_time;
+  int *event_with;
+
+  // Cells per axis are 1 << grid_bits, with side cell_side starting at lo.
+  // The cell arrays are in the scratch file too, sized for max_bits.
+  int max_bits;
+  int grid_bits;
+  double lo[3];
+  double cell_side;
+  // Cell c holds work[cell_start[c], cell_start[c + 1]).
+  int *cell_start;
+  int *cursor;
+  // nodes[l] has one entry per node l levels above the cells.
+  ooc_node_t *nodes[OOC_MAX_GRID_BITS + 1];
+
+  // One extent per block of the spheres, merged by size_grid.
+  ooc_extent_t *partial;
+  int n_large;
+  ooc_large_t large[OOC_MAX_LARGE];
+
+  // Binary min-heap of predicted collisions.
+  ooc_event_t *heap;
+  size_t heap_size;
+  size_t heap_cap;
+};
+
+static uint32_t spread_bits(uint32_t v) {
+  uint32_t r = 0;
+  for (int b = 0; b < OOC_MAX_GRID_BITS; b++) {
+    r |= ((v >> b) & 1u) << (3 * b);
+  }
+  return r;
+}
+
+static uint32_t compact_bits(uint32_t v) {
+  uint32_t r = 0;
+  for (int b = 0; b < OOC_MAX_GRID_BITS; b++) {
+    r |= ((v >> (3 * b)) & 1u) << b;
+  }
+  return r;
+}
+
+static uint32_t cell_key(int x, int y, int z) {
+  return spread_bits(x) | spread_bits(y) << 1 | spread_bits(z) << 2;
+}
+
+static int n_cells(const out_of_core_t *ooc) {
+  return 1 << (3 * ooc->grid_bits);
+}
+
+// Grid coordinate of p along one axis, clamped into the grid; NaNs land in
+// cell 0.
+static int grid_coord(const out_of_core_t *ooc, int axis, float p) {
+  double c = floor(((double)p - ooc->lo[axis]) / ooc->cell_side);
+  int last = (1 << ooc->grid_bits) - 1;
+  if (!(c >= 0)) {
+    return 0;
+  }
+  return c > last ? last : (int)c;
+}
+
+static uint32_t cell_of(const out_of_core_t *ooc, vector_t p) {
+  return cell_key(grid_coord(ooc, 0, p.x), grid_coord(ooc, 1, p.y), grid_coord(ooc, 2, p.z));
+}
+
+// Cell holding work slot s.
+static int cell_of_slot(const out_of_core_t *ooc, int s) {
+  int lo = 0, hi = n_cells(ooc);
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (ooc->cell_start[mid] <= s) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static size_t page_round(size_t bytes) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (bytes + page - 1) / page * page;
+}
+
+// Maps an unlinked scratch file of the given size in dir.
+static char *map_scratch(const char *dir, size_t bytes) {
+  if (dir == NULL) {
+    dir = getenv("TMPDIR");
+  }
+  if (dir == NULL || dir[0] == '\0') {
+    dir = "/tmp";
+  }
+  char path[4096];
+  if (snprintf(path, sizeof(path), "%s/spheres-ooc-XXXXXX", dir) >= (int)sizeof(path)) {
+    return NULL;
+  }
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return NULL;
+  }
+  unlink(path);
+  char *map = NULL;
+  if (ftruncate(fd, (off_t)bytes) == 0) {
+    map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      map = NULL;
+    }
+  }
+  close(fd);
+  return map;
+}
+
+out_of_core_t *out_of_core_create(const simulator_spec_t *spec,
+                                  const sim_out_of_core_options_t *options) {
+  sim_out_of_core_options_t defaults = {.dir = NULL, .opening_angle = OOC_DEFAULT_OPENING_ANGLE};
+  if (options == NULL) {
+    options = &defaults;
+  }
+  if (!(options->opening_angle >= 0)) {
+    return NULL;
+  }
+  out_of_core_t *ooc = calloc(1, sizeof(out_of_core_t));
+  if (ooc == NULL) {
+    return NULL;
+  }
+  int n = spec->n_spheres;
+  ooc->n_spheres = n;
+  ooc->g = spec->g;
+  ooc->time_step = n > 1 ? (1 / log(n)) : 1;
+  ooc->opening_angle = options->opening_angle;
+
+  while (ooc->max_bits < OOC_MAX_GRID_BITS &&
+         ((size_t)OOC_MIN_CELL_SPHERES << (3 * (ooc->max_bits + 1))) <= (size_t)n) {
+    ooc->max_bits++;
+  }
+  size_t max_cells = (size_t)1 << (3 * ooc->max_bits);
+
+  size_t spheres_bytes = page_round((size_t)n * sizeof(sphere_t));
+  size_t ints_bytes = page_round((size_t)n * sizeof(int));
+  size_t vectors_bytes = page_round((size_t)n * sizeof(vector_t));
+  size_t cells_bytes = page_round((max_cells + 1) * sizeof(int));
+  size_t nodes_bytes[OOC_MAX_GRID_BITS + 1];
+  ooc->map_bytes = 3 * spheres_bytes + 6 * ints_bytes + vectors_bytes + 2 * cells_bytes;
+  for (int l = 0; l <= ooc->max_bits; l++) {
+    nodes_bytes[l] = page_round((max_cells >> (3 * l)) * sizeof(ooc_node_t));
+    ooc->map_bytes += nodes_bytes[l];
+  }
+  ooc->map = map_scratch(options->dir, ooc->map_bytes);
+  int n_blocks = (n + OOC_BLOCK - 1) / OOC_BLOCK;
+  ooc->partial = malloc((size_t)(n_blocks > 0 ? n_blocks : 1) * sizeof(ooc_extent_t));
+  ooc->heap_cap = 1024;
+  ooc->heap = malloc(ooc->heap_cap * sizeof(ooc_event_t));
+  if (ooc->map == NULL || ooc->partial == NULL || ooc->heap == NULL) {
+    out_of_core_destroy(ooc);
+    return NULL;
+  }
+
+  char *p = ooc->map;
+  ooc->out = (sphere_t *)p;
+  ooc->work = (sphere_t *)(p += spheres_bytes);
+  ooc->work_next = (sphere_t *)(p += spheres_bytes);
+  ooc->index = (int *)(p += spheres_bytes);
+  ooc->index_next = (int *)(p += ints_bytes);
+  ooc->clock = (float *)(p += ints_bytes);
+  ooc->version = (uint32_t *)(p += ints_bytes);
+  ooc->event_with = (int *)(p += ints_bytes);
+  ooc->event_time = (float *)(p += ints_bytes);
+  ooc->next_accel = (vector_t *)(p += ints_bytes);
+  ooc->cell_start = (int *)(p += vectors_bytes);
+  ooc->cursor = (int *)(p += cells_bytes);
+  p += cells_bytes;
+  for (int l = 0; l <= ooc->max_bits; l++) {
+    ooc->nodes[l] = (ooc_node_t *)p;
+    p += nodes_bytes[l];
+  }
+
+  memcpy(ooc->out, spec->spheres, (size_t)n * sizeof(sphere_t));
+  memcpy(ooc->work, spec->spheres, (size_t)n * sizeof(sphere_t));
+  cilk_for (int i = 0; i < n; i++) {
+    ooc->index[i] = i;
+  }
+  return ooc;
+}
+
+void out_of_core_destroy(out_of_core_t *ooc) {
+  if (ooc->map != NULL) {
+    munmap(ooc->map, ooc->map_bytes);
+  }
+  free(ooc->partial);
+  free(ooc->heap);
+  free(ooc);
+}
+
+sphere_t *out_of_core_spheres(out_of_core_t *ooc) {
+  return ooc->out;
+}
+
+// How far from a sphere another one can be and still meet it within the
+// frame, if it reaches no further: both drift at their starting speed plus
+// what gravity adds over the frame.
+static double sphere_reach(const out_of_core_t *ooc, const sphere_t *sp) {
+  double t = ooc->time_step;
+  double drift = t * ((double)qsize(sp->vel) + t * (double)qsize(sp->accel));
+  return 2 * ((double)sp->r + drift);
+}
+
+static int reach_bin(double reach) {
+  int bin = reach > 0 ? ilogb(reach) + OOC_REACH_BINS / 2 : 0;
+  return max(0, min(bin, OOC_REACH_BINS - 1));
+}
+
+static void block_extent(const out_of_core_t *ooc, int lo, int hi, ooc_extent_t *e) {
+  memset(e, 0, sizeof(*e));
+  for (int a = 0; a < 3; a++) {
+    e->lo[a] = INFINITY;
+    e->hi[a] = -INFINITY;
+  }
+  for (int s = lo; s < hi; s++) {
+    const sphere_t *sp = &ooc->work[s];
+    double p[3] = {sp->pos.x, sp->pos.y, sp->pos.z};
+    for (int a = 0; a < 3; a++) {
+      if (isfinite(p[a])) {
+        e->lo[a] = fmin(e->lo[a], p[a]);
+        e->hi[a] = fmax(e->hi[a], p[a]);
+      }
+    }
+    double reach = sphere_reach(ooc, sp);
+    if (isfinite(reach)) {
+      int bin = reach_bin(reach);
+      e->count[bin]++;
+      e->max[bin] = fmax(e->max[bin], reach);
+    }
+  }
+}
+
+// Picks the finest grid whose cells are still at least a reach across for
+// all but the OOC_MAX_LARGE spheres that reach furthest, so that other
+// spheres able to collide this frame sit in the same or neighbouring cells.
+static void size_grid(out_of_core_t *ooc) {
+  int n = ooc->n_spheres;
+  int n_blocks = (n + OOC_BLOCK - 1) / OOC_BLOCK;
+  ooc_extent_t *partial = ooc->partial;
+  cilk_for (int b = 0; b < n_blocks; b++) {
+    block_extent(ooc, b * OOC_BLOCK, min((b + 1) * OOC_BLOCK, n), &partial[b]);
+  }
+  ooc_extent_t e;
+  block_extent(ooc, 0, 0, &e);
+  for (int b = 0; b < n_blocks; b++) {
+    for (int a = 0; a < 3; a++) {
+      e.lo[a] = fmin(e.lo[a], partial[b].lo[a]);
+      e.hi[a] = fmax(e.hi[a], partial[b].hi[a]);
+    }
+    for (int k = 0; k < OOC_REACH_BINS; k++) {
+      e.count[k] += partial[b].count[k];
+      e.max[k] = fmax(e.max[k], partial[b].max[k]);
+    }
+  }
+  // The bins from cut up hold at most OOC_MAX_LARGE spheres, and the grid
+  // only has to fit the ones below.
+  int cut = OOC_REACH_BINS, above = 0;
+  while (cut > 0 && above + e.count[cut - 1] <= OOC_MAX_LARGE) {
+    above += e.count[--cut];
+  }
+  double reach = 0;
+  for (int k = 0; k < cut; k++) {
+    reach = fmax(reach, e.max[k]);
+  }
+
+  double side = 0;
+  for (int a = 0; a < 3; a++) {
+    if (e.lo[a] > e.hi[a]) {
+      e.lo[a] = e.hi[a] = 0;
+    }
+    ooc->lo[a] = e.lo[a];
+    side = fmax(side, e.hi[a] - e.lo[a]);
+  }
+  ooc->grid_bits = 0;
+  while (ooc->grid_bits < ooc->max_bits && ldexp(side, -(ooc->grid_bits + 1)) >= OOC_SLACK * reach) {
+    ooc->grid_bits++;
+  }
+  // A little over the exact side, so the far faces fall inside the grid.
+  ooc->cell_side = side > 0 && isfinite(side) ? ldexp(side, -ooc->grid_bits) * OOC_SLACK : 1;
+}
+
+// Cells a sphere with the given reach has to search on either side of its
+// own. That is 1 for all but the spheres size_grid left out, so at most
+// OOC_MAX_LARGE spheres get more.
+static int reach_span(const out_of_core_t *ooc, double reach) {
+  if (ooc->grid_bits == 0 || !isfinite(reach) || OOC_SLACK * reach <= ooc->cell_side) {
+    return 1;
+  }
+  return (int)fmin(ceil(OOC_SLACK * reach / ooc->cell_side), 1 << ooc->grid_bits);
+}
+
+// Sorts work into cells for the current positions: one pass to count the
+// spheres in every cell, one to move them over in order and list the large
+// ones.
+static void regroup(out_of_core_t *ooc) {
+  int n = ooc->n_spheres;
+  size_grid(ooc);
+  int cells = n_cells(ooc);
+  memset(ooc->cell_start, 0, (cells + 1) * sizeof(int));
+  for (int s = 0; s < n; s++) {
+    ooc->cell_start[cell_of(ooc, ooc->work[s].pos) + 1]++;
+  }
+  for (int c = 0; c < cells; c++) {
+    ooc->cell_start[c + 1] += ooc->cell_start[c];
+    ooc->cursor[c] = ooc->cell_start[c];
+  }
+  ooc->n_large = 0;
+  for (int s = 0; s < n; s++) {
+    int to = ooc->cursor[cell_of(ooc, ooc->work[s].pos)]++;
+    ooc->work_next[to] = ooc->work[s];
+    ooc->index_next[to] = ooc->index[s];
+    int span = reach_span(ooc, sphere_reach(ooc, &ooc->work[s]));
+    if (span > 1 && ooc->n_large < OOC_MAX_LARGE) {
+      ooc->large[ooc->n_large++] = (ooc_large_t){to, span};
+    }
+  }
+  sphere_t *work = ooc->work;
+  ooc->work = ooc->work_next;
+  ooc->work_next = work;
+  int *index = ooc->index;
+  ooc->index = ooc->index_next;
+  ooc->index_next = index;
+}
+
+// Fills in the node sums, cells first and then every level above from the
+// eight nodes below it.
+static void summarize(out_of_core_t *ooc) {
+  int cells = n_cells(ooc);
+  ooc_node_t *leaves = ooc->nodes[0];
+  cilk_for (int c = 0; c < cells; c++) {
+    ooc_node_t node = {0, 0, 0, 0};
+    for (int s = ooc->cell_start[c]; s < ooc->cell_start[c + 1]; s++) {
+      const sphere_t *sp = &ooc->work[s];
+      node.mass += sp->mass;
+      node.x += (double)sp->mass * sp->pos.x;
+      node.y += (double)sp->mass * sp->pos.y;
+      node.z += (double)sp->mass * sp->pos.z;
+    }
+    leaves[c] = node;
+  }
+  for (int l = 1; l <= ooc->grid_bits; l++) {
+    const ooc_node_t *below = ooc->nodes[l - 1];
+    ooc_node_t *level = ooc->nodes[l];
+    cilk_for (int k = 0; k < cells >> (3 * l); k++) {
+      ooc_node_t node = {0, 0, 0, 0};
+      for (int c = 0; c < 8; c++) {
+        node.mass += below[8 * k + c].mass;
+        node.x += below[8 * k + c].x;
+        node.y += below[8 * k + c].y;
+        node.z += below[8 * k + c].z;
+      }
+      level[k] = node;
+    }
+  }
+}
+
+static void pull(double acc[3], double gm, double dx, double dy, double dz) {
+  double d2 = dx * dx + dy * dy + dz * dz;
+  if (!(d2 > 0)) {
+    return;
+  }
+  double f = gm / (d2 * sqrt(d2));
+  acc[0] += f * dx;
+  acc[1] += f * dy;
+  acc[2] += f * dz;
+}
+
+// Adds the pull of the spheres under node key on level to the sphere in
+// work slot s, opening the node unless it is small and far enough from the
+// sphere to stand in for them.
+static void add_node(const out_of_core_t *ooc, int level, uint32_t key, int s, double acc[3]) {
+  const ooc_node_t *node = &ooc->nodes[level][key];
+  if (node->mass == 0) {
+    return;
+  }
+  vector_t p = ooc->work[s].pos;
+  double size = ldexp(ooc->cell_side, level);
+  double corner[3] = {ooc->lo[0] + size * compact_bits(key),
+                      ooc->lo[1] + size * compact_bits(key >> 1),
+                      ooc->lo[2] + size * compact_bits(key >> 2)};
+  bool inside = p.x >= corner[0] && p.x <= corner[0] + size && p.y >= corner[1] &&
+                p.y <= corner[1] + size && p.z >= corner[2] && p.z <= corner[2] + size;
+  double dx = node->x / node->mass - p.x;
+  double dy = node->y / node->mass - p.y;
+  double dz = node->z / node->mass - p.z;
+  if (!inside && size < ooc->opening_angle * sqrt(dx * dx + dy * dy + dz * dz)) {
+    pull(acc, ooc->g * node->mass, dx, dy, dz);
+    return;
+  }
+  if (level > 0) {
+    for (uint32_t c = 0; c < 8; c++) {
+      add_node(ooc, level - 1, 8 * key + c, s, acc);
+    }
+    return;
+  }
+  for (int j = ooc->cell_start[key]; j < ooc->cell_start[key + 1]; j++) {
+    if (j != s) {
+      const sphere_t *sj = &ooc->work[j];
+      pull(acc, ooc->g * sj->mass, (double)sj->pos.x - p.x, (double)sj->pos.y - p.y,
+           (double)sj->pos.z - p.z);
+    }
+  }
+}
+
+// Accelerations at the frame's starting positions, for the next frame.
+static void compute_accelerations(out_of_core_t *ooc) {
+  cilk_for (int c = 0; c < n_cells(ooc); c++) {
+    for (int s = ooc->cell_start[c]; s < ooc->cell_start[c + 1]; s++) {
+      double acc[3] = {0, 0, 0};
+      add_node(ooc, ooc->grid_bits, 0, s, acc);
+      ooc->next_accel[s] = (vector_t){acc[0], acc[1], acc[2]};
+    }
+  }
+}
+
+// Sphere s as it is at time t into the frame, moving the way a ministep
+// from its clock to t would move it.
+static sphere_t sphere_at(const out_of_core_t *ooc, int s, float t) {
+  sphere_t sp = ooc->work[s];
+  float dt = t - ooc->clock[s];
+  sp.pos = qadd(sp.pos, scale(dt, sp.vel));
+  sp.vel = qadd(sp.vel, scale(dt, sp.accel));
+  return sp;
+}
+
+// Checks spheres s and j from the later of their clocks, lowering *best to
+// their collision if it comes first.
+static void predict_pair(const out_of_core_t *ooc, int s, int j, float *best, int *with,
+                         scan_counts_t *counts) {
+  float start = max(ooc->clock[s], ooc->clock[j]);
+  sphere_t pair[2] = {sphere_at(ooc, s, start), sphere_at(ooc, j, start)};
+  float left = *best - start;
+  if (left > 0 && check_for_collision(pair, 0, 1, &left, counts)) {
+    *best = start + left;
+    *with = j;
+  }
+}
+
+// Earliest collision of sphere s before the frame ends; *with is -1 if
+// there is none. Spheres search their own and the neighbouring cells, or
+// further out if they are large, and check every large sphere; a pair
+// either sits that close or has a large sphere reaching the other.
+static float predict(const out_of_core_t *ooc, int s, int *with) {
+  scan_counts_t counts = {0, 0};
+  float best = ooc->time_step;
+  *with = -1;
+  int span = 1;
+  for (int k = 0; k < ooc->n_large; k++) {
+    if (ooc->large[k].slot == s) {
+      span = ooc->large[k].span;
+    }
+  }
+  uint32_t key = cell_of_slot(ooc, s);
+  int x = compact_bits(key), y = compact_bits(key >> 1), z = compact_bits(key >> 2);
+  int last = (1 << ooc->grid_bits) - 1;
+  for (int cx = max(x - span, 0); cx <= min(x + span, last); cx++) {
+    for (int cy = max(y - span, 0); cy <= min(y + span, last); cy++) {
+      for (int cz = max(z - span, 0); cz <= min(z + span, last); cz++) {
+        uint32_t c = cell_key(cx, cy, cz);
+        for (int j = ooc->cell_start[c]; j < ooc->cell_start[c + 1]; j++) {
+          if (j != s) {
+            predict_pair(ooc, s, j, &best, with, &counts);
+          }
+        }
+      }
+    }
+  }
+  for (int k = 0; k < ooc->n_large; k++) {
+    if (ooc->large[k].slot != s) {
+      predict_pair(ooc, s, ooc->large[k].slot, &best, with, &counts);
+    }
+  }
+  return best;
+}
+
+static bool event_before(const ooc_event_t *a, const ooc_event_t *b) {
+  if (a->time != b->time) {
+    return a->time < b->time;
+  }
+  return a->i != b->i ? a->i < b->i : a->j < b->j;
+}
+
+// Returns false, leaving the heap as it was, if it could not grow.
+static bool push_event(out_of_core_t *ooc, ooc_event_t event) {
+  if (ooc->heap_size == ooc->heap_cap) {
+    ooc_event_t *grown = realloc(ooc->heap, 2 * ooc->heap_cap * sizeof(ooc_event_t));
+    if (grown == NULL) {
+      return false;
+    }
+    ooc->heap = grown;
+    ooc->heap_cap *= 2;
+  }
+  size_t k = ooc->heap_size++;
+  while (k > 0 && event_before(&event, &ooc->heap[(k - 1) / 2])) {
+    ooc->heap[k] = ooc->heap[(k - 1) / 2];
+    k = (k - 1) / 2;
+  }
+  ooc->heap[k] = event;
+  return true;
+}
+
+static ooc_event_t pop_event(out_of_core_t *ooc) {
+  ooc_event_t top = ooc->heap[0];
+  ooc_event_t last = ooc->heap[--ooc->heap_size];
+  size_t k = 0;
+  while (true) {
+    size_t child = 2 * k + 1;
+    if (child >= ooc->heap_size) {
+      break;
+    }
+    if (child + 1 < ooc->heap_size && event_before(&ooc->heap[child + 1], &ooc->heap[child])) {
+      child++;
+    }
+    if (!event_before(&ooc->heap[child], &last)) {
+      break;
+    }
+    ooc->heap[k] = ooc->heap[child];
+    k = child;
+  }
+  ooc->heap[k] = last;
+  return top;
+}
+
+static bool push_prediction(out_of_core_t *ooc, int s) {
+  int with;
+  float time = predict(ooc, s, &with);
+  return with < 0 || push_event(ooc, (ooc_event_t){time, s, with, ooc->version[s], ooc->version[with]});
+}
+
+// Bounces spheres i and j off each other like do_ministep.
+static void bounce(sphere_t *si, sphere_t *sj) {
+  vector_t distVec = qsubtract(si->pos, sj->pos);
+  float scale1 = 2 * sj->mass / (float)((double)si->mass + (double)sj->mass);
+  float scale2 = 2 * si->mass / (float)((double)si->mass + (double)sj->mass);
+  float distNorm = qdot(distVec, distVec);
+  vector_t velDiff = qsubtract(si->vel, sj->vel);
+  vector_t scaledDist = scale(qdot(velDiff, distVec) / distNorm, distVec);
+  si->vel = qsubtract(si->vel, scale(scale1, scaledDist));
+  sj->vel = qsubtract(sj->vel, scale(-1 * scale2, scaledDist));
+}
+
+// Resolves the frame's collisions in time order. Only the two spheres of a
+// collision are advanced to it; everyone else keeps their clock until
+// they collide or the frame ends. A prediction goes stale once either of
+// its spheres has collided since, and if only the partner has, the sphere
+// it was for gets a fresh one. Returns -1 if the event heap could not grow.
+static int resolve_collisions(out_of_core_t *ooc) {
+  int n = ooc->n_spheres;
+  cilk_for (int s = 0; s < n; s++) {
+    ooc->clock[s] = 0;
+    ooc->version[s] = 0;
+  }
+  cilk_for (int c = 0; c < n_cells(ooc); c++) {
+    for (int s = ooc->cell_start[c]; s < ooc->cell_start[c + 1]; s++) {
+      ooc->event_time[s] = predict(ooc, s, &ooc->event_with[s]);
+    }
+  }
+  ooc->heap_size = 0;
+  for (int s = 0; s < n; s++) {
+    if (ooc->event_with[s] >= 0 &&
+        !push_event(ooc, (ooc_event_t){ooc->event_time[s], s, ooc->event_with[s], 0, 0})) {
+      return -1;
+    }
+  }
+
+  int collisions = 0;
+  while (ooc->heap_size > 0) {
+    ooc_event_t e = pop_event(ooc);
+    if (e.version_i != ooc->version[e.i]) {
+      continue;
+    }
+    if (e.version_j != ooc->version[e.j]) {
+      if (!push_prediction(ooc, e.i)) {
+        return -1;
+      }
+      continue;
+    }
+    ooc->work[e.i] = sphere_at(ooc, e.i, e.time);
+    ooc->work[e.j] = sphere_at(ooc, e.j, e.time);
+    ooc->clock[e.i] = ooc->clock[e.j] = e.time;
+    bounce(&ooc->work[e.i], &ooc->work[e.j]);
+    ooc->version[e.i]++;
+    ooc->version[e.j]++;
+    collisions++;
+    if (!push_prediction(ooc, e.i) || !push_prediction(ooc, e.j)) {
+      return -1;
+    }
+  }
+  return collisions;
+}
+
+int out_of_core_frame(out_of_core_t *ooc) {
+  int n = ooc->n_spheres;
+  regroup(ooc);
+  summarize(ooc);
+  compute_accelerations(ooc);
+  int collisions = resolve_collisions(ooc);
+  if (collisions < 0) {
+    return -1;
+  }
+  cilk_for (int s = 0; s < n; s++) {
+    sphere_t sp = sphere_at(ooc, s, ooc->time_step);
+    sp.accel = ooc->next_accel[s];
+    ooc->work[s] = sp;
+    ooc->out[ooc->index[s]] = sp;
+  }
+  // Everything is in the file now; let the kernel drop it from the process
+  // rather than keep a frame's worth of pages resident.
+  madvise(ooc->map, ooc->map_bytes, MADV_DONTNEED);
+  return collisions;
+}
@@ -0,0 +1,247 @@
+#include "../include/parareal.h"
+
+#include <cilk/cilk.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/misc_utils.h"
+
+struct parareal {
+  sim_parareal_options_t options;
+  int n_spheres;
+  double g;
+  float time_step;
+  // frames[f] is the start of frame f of the window, so frames[0] is where
+  // the window starts and frames[window] where it ends; n_spheres each.
+  sphere_t *frames;
+  // fine[f] is a fine frame started from frames[f], and coarse[f] the
+  // coarse one it is corrected against.
+  sphere_t *fine;
+  sphere_t *coarse;
+  sphere_t *scratch;
+  bool *collided;
+  // Simulator fine[f] is run on, kept from round to round.
+  struct simulator_state **fine_sims;
+  // Frames still to hand out are frames[next, ready].
+  int next;
+  int ready;
+  // Frames left to run sequentially after a fallback.
+  int cooldown;
+  sim_parareal_stats_t stats;
+};
+
+static sphere_t *frame(const parareal_t *p, sphere_t *base, int f) {
+  return base + (size_t)f * p->n_spheres;
+}
+
+parareal_t *parareal_create(const simulator_spec_t *spec, const sim_parareal_options_t *options) {
+  if (options->window < 1 || options->max_iterations < 1 || !(options->tolerance >= 0)) {
+    return NULL;
+  }
+  parareal_t *p = calloc(1, sizeof(parareal_t));
+  if (p == NULL) {
+    return NULL;
+  }
+  int n = spec->n_spheres;
+  size_t window_bytes = (size_t)options->window * n * sizeof(sphere_t);
+  p->options = *options;
+  p->n_spheres = n;
+  p->g = spec->g;
+  p->time_step = n > 1 ? (1 / log(n)) : 1;
+  p->frames = malloc(window_bytes + (size_t)n * sizeof(sphere_t));
+  p->fine = malloc(window_bytes);
+  p->coarse = malloc(window_bytes);
+  p->scratch = malloc((size_t)n * sizeof(sphere_t));
+  p->collided = malloc((size_t)options->window * sizeof(bool));
+  p->fine_sims = calloc((size_t)options->window, sizeof(struct simulator_state *));
+  if (p->frames == NULL || (n > 0 && (p->fine == NULL || p->coarse == NULL || p->scratch == NULL)) ||
+      p->collided == NULL || p->fine_sims == NULL) {
+    parareal_destroy(p);
+    return NULL;
+  }
+  // Made here rather than in the rounds, one at a time, so that calibration
+  // in init_simulator never runs alongside the fine frames.
+  for (int f = 0; f < options->window; f++) {
+    p->fine_sims[f] = init_simulator(spec);
+    if (p->fine_sims[f] == NULL) {
+      parareal_destroy(p);
+      return NULL;
+    }
+  }
+  return p;
+}
+
+void parareal_destroy(parareal_t *p) {
+  if (p->fine_sims != NULL) {
+    for (int f = 0; f < p->options.window; f++) {
+      if (p->fine_sims[f] != NULL) {
+        destroy_simulator(p->fine_sims[f]);
+      }
+    }
+  }
+  free(p->fine_sims);
+  free(p->frames);
+  free(p->fine);
+  free(p->coarse);
+  free(p->scratch);
+  free(p->collided);
+  free(p);
+}
+
+sim_parareal_stats_t parareal_stats(const parareal_t *p) {
+  return p->stats;
+}
+
+// One frame of the coarse propagator. It has the same shape as a
+// collision-free simulate() frame, integrating with the acceleration the
+// spheres came in with and leaving behind the one at their starting
+// positions, but does the gravity in plain single precision.
+static void coarse_step(const parareal_t *p, const sphere_t *in, sphere_t *out) {
+  int n = p->n_spheres;
+  float g = p->g;
+  float dt = p->time_step;
+  cilk_for (int i = 0; i < n; i++) {
+    float ax = 0, ay = 0, az = 0;
+    for (int j = 0; j < n; j++) {
+      if (j == i) continue;
+      float dx = in[j].pos.x - in[i].pos.x;
+      float dy = in[j].pos.y - in[i].pos.y;
+      float dz = in[j].pos.z - in[i].pos.z;
+      float inv = 1 / sqrtf(dx * dx + dy * dy + dz * dz);
+      float f = g * in[j].mass * inv * inv * inv;
+      ax += f * dx;
+      ay += f * dy;
+      az += f * dz;
+    }
+    out[i] = in[i];
+    out[i].vel = qadd(in[i].vel, scale(dt, in[i].accel));
+    out[i].pos = qadd(in[i].pos, scale(dt, in[i].vel));
+    out[i].accel = (vector_t){ax, ay, az};
+  }
+}
+
+// One simulate() frame from start into out on fine simulator f; returns
+// whether it resolved any collision.
+static bool fine_step(const parareal_t *p, int f, const sphere_t *start, sphere_t *out) {
+  struct simulator_state *sim = p->fine_sims[f];
+  simulator_restart(sim, start);
+  memcpy(out, simulate(sim), (size_t)p->n_spheres * sizeof(sphere_t));
+  return simulator_frame_collisions(sim) > 0;
+}
+
+// out = corrected + fine - coarse, field by field.
+static vector_t correct(vector_t corrected, vector_t fine, vector_t coarse) {
+  return qadd(corrected, qsubtract(fine, coarse));
+}
+
+static double extent(const sphere_t *spheres, int n) {
+  if (n == 0) {
+    return 0;
+  }
+  vector_t lo = spheres[0].pos, hi = spheres[0].pos;
+  for (int i = 1; i < n; i++) {
+    lo.x = min(lo.x, spheres[i].pos.x);
+    lo.y = min(lo.y, spheres[i].pos.y);
+    lo.z = min(lo.z, spheres[i].pos.z);
+    hi.x = max(hi.x, spheres[i].pos.x);
+    hi.y = max(hi.y, spheres[i].pos.y);
+    hi.z = max(hi.z, spheres[i].pos.z);
+  }
+  return qdist(lo, hi);
+}
+
+// Works out frames[1, window] from frames[0] and returns how many of them
+// can be handed out.
+//
+// Frames up to `exact` are known to match sequential simulation: the frame
+// after one of them is a fine frame from an exact start, so it is taken as
+// is rather than through the correction, whose rounding would spoil it.
+// That way every round makes at least one more frame exact.
+static int run_window(parareal_t *p) {
+  int n = p->n_spheres;
+  size_t bytes = (size_t)n * sizeof(sphere_t);
+  int window = p->options.window;
+  double tolerance = p->options.tolerance * extent(p->frames, n);
+
+  for (int f = 0; f < window; f++) {
+    coarse_step(p, frame(p, p->frames, f), frame(p, p->coarse, f));
+    memcpy(frame(p, p->frames, f + 1), frame(p, p->coarse, f), bytes);
+  }
+
+  int exact = 0;
+  bool fallback = false;
+  for (int round = 0; round < p->options.max_iterations && exact < window; round++) {
+    p->stats.iterations++;
+    cilk_for (int f = exact; f < window; f++) {
+      p->collided[f] = fine_step(p, f, frame(p, p->frames, f), frame(p, p->fine, f));
+    }
+    // Coarse frames cannot follow a collision, so the window ends with the
+    // first fine frame that had one.
+    for (int f = exact; f < window; f++) {
+      if (p->collided[f]) {
+        window = f + 1;
+        fallback = true;
+        break;
+      }
+    }
+
+    double moved = 0;
+    bool start_unchanged = true;
+    for (int f = exact; f < window; f++) {
+      sphere_t *next = frame(p, p->frames, f + 1);
+      if (start_unchanged) {
+        // frames[f] is the start fine[f] was run from.
+        start_unchanged = memcmp(next, frame(p, p->fine, f), bytes) == 0;
+        memcpy(next, frame(p, p->fine, f), bytes);
+        if (f == exact) {
+          exact++;
+        }
+        continue;
+      }
+      coarse_step(p, frame(p, p->frames, f), p->scratch);
+      for (int i = 0; i < n; i++) {
+        sphere_t *fine = &frame(p, p->fine, f)[i], *coarse = &frame(p, p->coarse, f)[i];
+        sphere_t updated = p->scratch[i];
+        updated.pos = correct(p->scratch[i].pos, fine->pos, coarse->pos);
+        updated.vel = correct(p->scratch[i].vel, fine->vel, coarse->vel);
+        updated.accel = correct(p->scratch[i].accel, fine->accel, coarse->accel);
+        moved = max(moved, qdist(updated.pos, next[i].pos));
+        next[i] = updated;
+      }
+      memcpy(frame(p, p->coarse, f), p->scratch, bytes);
+    }
+    if (p->options.tolerance > 0 && moved <= tolerance) {
+      exact = window;
+    }
+  }
+
+  p->stats.windows++;
+  if (fallback) {
+    p->stats.fallbacks++;
+    p->cooldown = p->options.window;
+  }
+  return exact;
+}
+
+bool parareal_next_frame(parareal_t *p, sphere_t *spheres, sim_precision_e precision) {
+  size_t bytes = (size_t)p->n_spheres * sizeof(sphere_t);
+  if (p->next >= p->ready) {
+    if (p->cooldown > 0) {
+      p->cooldown--;
+      return false;
+    }
+    for (int f = 0; f < p->options.window; f++) {
+      if (simulator_set_precision(p->fine_sims[f], precision) != 0) {
+        return false;
+      }
+    }
+    memcpy(p->frames, spheres, bytes);
+    p->ready = run_window(p);
+    p->next = 0;
+  }
+  p->next++;
+  memcpy(spheres, frame(p, p->frames, p->next), bytes);
+  p->stats.frames_accepted++;
+  return true;
+}
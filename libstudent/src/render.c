@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <cilk/cilk.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +15,14 @@
 
 #include "../../common/render.h"
 #include "../include/misc_utils.h"
+#include "../include/render_bvh.h"
+#include "../include/render_cull.h"
+#include "../include/render_ext.h"
+#include "../include/render_kernels.h"
+#include "../include/render_sort.h"
+#include "../include/render_span.h"
+#include "../include/render_tiles.h"
+#include "../include/tuning.h"
 
 typedef struct renderer_state {
   renderer_spec_t r_spec;
@@ -22,9 +31,49 @@ typedef struct renderer_state {
   // newly added below:
   int total_pixels;
   float pixel_size;
-  ray_t* origin_rays;
+  // Direction of the primary ray through every pixel, one component per
+  // array so packets of pixels load as vectors; the rays all start at the
+  // eye. The camera is fixed once init_renderer returns, so these are
+  // computed on the first render() and kept.
+  float* ray_x;
+  float* ray_y;
+  float* ray_z;
+  bool rays_ready;
+  // The same rays in double, for working out sphere spans, and the planes
+  // they all lie within.
+  span_camera_t camera;
+  view_frustum_t frustum;
   float precompute1;
-  sphere_t* copy_spheres;
+  // Room for this many spheres in the buffers below; 0 until the first
+  // render().
+  int capacity;
+  // Input index of every sphere culling kept, in input order, its depth
+  // key, and the order drawing visits them in.
+  int* visible;
+  float* depth;
+  int* order;
+  // Where each block of cull writes its spheres to, with room for one block
+  // per sphere plus the total.
+  int* offsets;
+  // Spheres the last sort ordered, or 0 if order holds nothing useful. The
+  // next frame with as many visible spheres repairs that order instead of
+  // sorting from scratch.
+  int n_ordered;
+  depth_sort_t depth_sort;
+  // sorted[k] is the input sphere order[k], and bounding_region[4 * k] on
+  // its screen bounds (see find_bounding_region).
+  render_sphere_t* sorted;
+  int* bounding_region;
+  render_visibility_e visibility;
+  render_precision_e precision;
+  // Visibility buffer (see render_kernels.h), and the lights shading reads.
+  int* ids;
+  float* hit_t;
+  render_lights_t lights;
+  // Only allocated in RENDER_VISIBILITY_BVH, once the sphere count is known.
+  render_bvh_t bvh;
+  // Per-tile sphere lists of the raster mode.
+  tile_bins_t bins;
 } renderer_state_t;
 
 //Additional functions:
@@ -50,7 +99,7 @@ vector_t find_dir_in_plane(vector_t* point, vector_t* normal) {
 @return: the position of the 4 corners of the sphere's bounding square surface from the eye's perspective
 */
 inline __attribute__((always_inline))
-void get_corners(sphere_t* sphere, vector_t* corners, vector_t* eye){
+void get_corners(render_sphere_t* sphere, vector_t* corners, vector_t* eye){
   // Connect the eye to the center of the sphere, find the intersection of this line and the sphere's surface
   vector_t normal = qsubtract(*eye, sphere->pos);
   vector_t intersect = qadd(sphere->pos, scale(sphere->r, scale(1/qsize(normal), normal)));
@@ -75,7 +124,7 @@ void get_corners(sphere_t* sphere, vector_t* corners, vector_t* eye){
 @return the projections of the 8 corners of the bounding box of the sphere on the plane
 */
 inline __attribute__((always_inline))
-void corner_projection(sphere_t* sphere, renderer_state_t* state, vector_t* projections) {
+void corner_projection(render_sphere_t* sphere, renderer_state_t* state, vector_t* projections) {
 
   get_corners(sphere, projections, &state->r_spec.eye);
 
@@ -93,7 +142,7 @@ void corner_projection(sphere_t* sphere, renderer_state_t* state, vector_t* proj
 @return after finding the projections of the bounding box, find the smallest rectangle that contains all 8 projections
 */
 inline __attribute__((always_inline))
-void find_bounding_region(sphere_t* sphere, renderer_state_t* state, int* boundaries) {
+void find_bounding_region(render_sphere_t* sphere, renderer_state_t* state, int* boundaries) {
   double offset = (double)state->r_spec.viewport_size / (double)2;
   vector_t projections[4];
 
@@ -129,28 +178,140 @@ void find_bounding_region(sphere_t* sphere, renderer_state_t* state, int* bounda
 }
 // End additional functions
 
+// Returns NULL if the renderer could not be allocated.
 renderer_state_t* init_renderer(const renderer_spec_t *spec) {
-  renderer_state_t *state = (renderer_state_t*)malloc(sizeof(renderer_state_t));
+  // Zeroed, so destroy_renderer can clean up after a failure part way.
+  renderer_state_t *state = (renderer_state_t*)calloc(1, sizeof(renderer_state_t));
+  if (state == NULL) {
+    return NULL;
+  }
   state->r_spec = *spec;
   int n_pixels = state->r_spec.resolution * state->r_spec.resolution;
   state->img = calloc(3ull * (size_t) n_pixels, sizeof(float));
-  assert(state->img != NULL);
   state->plane_normal = qcross(state->r_spec.proj_plane_u, state->r_spec.proj_plane_v);
   state->total_pixels = (state->r_spec.resolution)*(state->r_spec.resolution);
   state->pixel_size = state->r_spec.viewport_size / state->r_spec.resolution;
-  state->origin_rays = calloc((size_t) state->total_pixels, sizeof(ray_t));
+  state->ray_x = calloc((size_t) state->total_pixels, sizeof(float));
+  state->ray_y = calloc((size_t) state->total_pixels, sizeof(float));
+  state->ray_z = calloc((size_t) state->total_pixels, sizeof(float));
+  state->rays_ready = false;
+  span_camera_init(&state->camera, &state->r_spec, state->pixel_size);
+  view_frustum_init(&state->frustum, &state->camera, state->r_spec.resolution);
   state->precompute1 = -qdot(state->plane_normal, state->r_spec.eye);
-  state->copy_spheres = NULL;
+  state->capacity = 0;
+  state->visible = NULL;
+  state->depth = NULL;
+  state->order = NULL;
+  state->offsets = NULL;
+  state->n_ordered = 0;
+  memset(&state->depth_sort, 0, sizeof(state->depth_sort));
+  state->sorted = NULL;
+  state->bounding_region = NULL;
+  state->visibility = RENDER_VISIBILITY_RASTER;
+  state->precision = RENDER_PRECISION_EXACT;
+  state->ids = malloc((size_t)state->total_pixels * sizeof(int));
+  state->hit_t = malloc((size_t)state->total_pixels * sizeof(float));
+  memset(&state->bvh, 0, sizeof(state->bvh));
+  if (state->img == NULL || state->ray_x == NULL || state->ray_y == NULL || state->ray_z == NULL ||
+      state->ids == NULL || state->hit_t == NULL || render_lights_init(&state->lights, &state->r_spec) != 0 ||
+      tile_bins_init(&state->bins, state->r_spec.resolution) != 0) {
+    destroy_renderer(state);
+    return NULL;
+  }
   return state;
 }
 
 void destroy_renderer(renderer_state_t *state) {
   free(state->img);
-  free(state->origin_rays);
-  free(state->copy_spheres);
+  free(state->ray_x);
+  free(state->ray_y);
+  free(state->ray_z);
+  free(state->visible);
+  free(state->depth);
+  free(state->order);
+  free(state->offsets);
+  depth_sort_destroy(&state->depth_sort);
+  free(state->sorted);
+  free(state->bounding_region);
+  free(state->ids);
+  free(state->hit_t);
+  render_lights_destroy(&state->lights);
+  render_bvh_destroy(&state->bvh);
+  tile_bins_destroy(&state->bins);
   free(state);
 }
 
+int renderer_set_visibility(renderer_state_t *state, render_visibility_e visibility) {
+  if (visibility != RENDER_VISIBILITY_RASTER && visibility != RENDER_VISIBILITY_BVH) {
+    return 1;
+  }
+  state->visibility = visibility;
+  return 0;
+}
+
+render_visibility_e renderer_visibility(const renderer_state_t *state) {
+  return state->visibility;
+}
+
+int renderer_set_precision(renderer_state_t *state, render_precision_e precision) {
+  if (precision != RENDER_PRECISION_EXACT && precision != RENDER_PRECISION_FAST) {
+    return 1;
+  }
+  state->precision = precision;
+  return 0;
+}
+
+render_precision_e renderer_precision(const renderer_state_t *state) {
+  return state->precision;
+}
+
+int renderer_visibility_buffer(const renderer_state_t *state, int *ids, float *t) {
+  if (state->capacity == 0) {
+    return 1;
+  }
+  for (int k = 0; k < state->total_pixels; k++) {
+    int id = state->ids[k];
+    ids[k] = id < 0 ? -1 : state->visible[state->order[id]];
+  }
+  if (t != NULL) {
+    memcpy(t, state->hit_t, (size_t)state->total_pixels * sizeof(float));
+  }
+  return 0;
+}
+
+// What the packet kernels need to draw spheres, which are in drawing order.
+static render_target_t packet_target(renderer_state_t* state, const render_sphere_t* spheres) {
+  render_target_t target = {
+      .spec = &state->r_spec,
+      .dir_x = state->ray_x,
+      .dir_y = state->ray_y,
+      .dir_z = state->ray_z,
+      .spheres = spheres,
+      .lights = &state->lights,
+      .ids = state->ids,
+      .t = state->hit_t,
+      .img = state->img,
+  };
+  return target;
+}
+
+// Shades pixels [x_low, x_high) of rows [y_low, y_high) from the
+// visibility buffer, RENDER_LANES pixels at a time.
+static void shade_rows(const render_target_t* target, int x_low, int x_high, int y_low, int y_high,
+                       render_precision_e precision) {
+  for (int y = y_low; y < y_high; y++) {
+    for (int x = x_low; x < x_high; x += RENDER_LANES) {
+      shade_packet(target, x, y, min(RENDER_LANES, x_high - x), precision);
+    }
+  }
+}
+
+// The primary ray through pixel k = x + y * resolution.
+static ray_t primary_ray(const renderer_state_t* state, size_t k) {
+  ray_t ray = {state->r_spec.eye, {state->ray_x[k], state->ray_y[k], state->ray_z[k]}};
+  return ray;
+}
+
 // Computes the ray from a given origin (usually the eye location) to the pixel (x, y)
 // in image coordinates.
 ray_t origin_to_pixel(renderer_state_t *state, int x, int y) {
@@ -174,156 +335,479 @@ ray_t origin_to_pixel(renderer_state_t *state, int x, int y) {
   return viewingRay;
 }
 
-// Determines whether the ray r and the sphere s intersect.
-// 
-// If the ray and the sphere intersect, writes the distance to the closer intersection
-// to `out`, and returns 1. Otherwise, returns 0.
-int ray_sphere_intersection(ray_t *r, const sphere_t* s, float *out) {
-  vector_t dist = qsubtract(r->origin, s->pos);
-  // Uses quadratic formula to compute intersection
-  float a = qdot(r->dir, r->dir);
-  float b = 2 * qdot(r->dir, dist);
-  float c = (float)((double)qdot(dist, dist) - (double)(s->r * s->r));
-  float discr = (float)((double)(b * b) - (double)(4 * a * c));
-
-  if (discr >= 0) {
-    // Ray hits sphere
-    float sqrtdiscr = sqrtf(discr);
-
-    float min_dist;
-    if (b >= 0) {
-      float sol1 = (float)((double)-b - (double)sqrtdiscr) / (2 * a);
-      float sol2 = (float)(2 * (double)c) / ((double)-b - (double)sqrtdiscr);
-      min_dist = min(sol1, sol2);
-    } else {
-      float sol1 = (float)(2 * (double)c) / ((double)-b + (double)sqrtdiscr);
-      float sol2 = (float)((double)-b + (double)sqrtdiscr) / (2 * a);
-      min_dist = min(sol1, sol2);
-    }
+// Length of the tangent from the eye to sphere, squared.
+static float depth_key(const renderer_state_t* state, const sphere_t* sphere) {
+  return (qdist(sphere->pos, state->r_spec.eye) * qdist(sphere->pos, state->r_spec.eye) - sphere->r * sphere->r);
+}
+
+// Whether cull keeps sphere, whose depth key is key. Spheres with NaN keys
+// are always kept: they split the depth order into segments, so dropping
+// one would reorder the spheres around it.
+static bool keep(const renderer_state_t* state, const sphere_t* sphere, float key) {
+  return depth_sort_barrier(key) || view_frustum_may_show(&state->frustum, sphere->pos, sphere->r);
+}
 
-    // If new_t > 0 and smaller than original t, we
-    // found a new, closer ray-sphere intersection
-    if (min_dist > 0) {
-      *out = min_dist;
-      return 1;
+// Drops the spheres no primary ray can hit. The input indices of the rest
+// go to state->visible, in input order, and their depth keys to
+// state->depth. Returns how many are left.
+//
+// Every block counts the spheres it keeps, the counts are summed into
+// offsets, and every block then writes its spheres from its offset on.
+int cull(renderer_state_t* restrict state, const sphere_t* restrict spheres, int n_spheres) {
+  int grain = tuning_grain(TUNE_RENDER_CULL, n_spheres);
+  int n_blocks = (n_spheres + grain - 1) / grain;
+  int* offsets = state->offsets;
+  offsets[0] = 0;
+  cilk_for (int b = 0; b < n_blocks; b++){
+    int count = 0;
+    for (int i = b * grain; i < min((b + 1) * grain, n_spheres); i++){
+      count += keep(state, &spheres[i], depth_key(state, &spheres[i]));
     }
+    offsets[b + 1] = count;
   }
-
-  return 0;
+  for (int b = 0; b < n_blocks; b++) {
+    offsets[b + 1] += offsets[b];
+  }
+  cilk_for (int b = 0; b < n_blocks; b++){
+    int j = offsets[b];
+    for (int i = b * grain; i < min((b + 1) * grain, n_spheres); i++){
+      float key = depth_key(state, &spheres[i]);
+      if (keep(state, &spheres[i], key)) {
+        state->visible[j] = i;
+        state->depth[j] = key;
+        j++;
+      }
+    }
+  }
+  return offsets[n_blocks];
 }
 
-// Sorts given spheres by length of the tangent (NOT in-place). 
-// Returns a pointer to the sorted spheres. Returned pointer must be freed.
+// Sorts the n_visible spheres cull kept by length of the tangent, into
+// state->order, and gathers them into state->sorted in that order. Spheres
+// barely move between frames, so the previous frame's order is repaired
+// when there is one.
 //
 // Since the spheres are non-intersecting, this ensures that 
 // if sphere S comes before sphere T in this ordering, then 
 // sphere S is in front of sphere T in the rendering.
-void sort(renderer_state_t* restrict state, const sphere_t* restrict orig_spheres, sphere_t* restrict spheres, int n_spheres) {
-  float* distance = calloc((size_t) n_spheres, sizeof(float));
-  int* new_ind = calloc((size_t) n_spheres, sizeof(int));
-  cilk_for (int i = 0; i < n_spheres; i++){
-    distance[i] = (qdist(spheres[i].pos, state->r_spec.eye) * qdist(spheres[i].pos, state->r_spec.eye) - spheres[i].r * spheres[i].r);
-  }
-  cilk_for(int i = 0; i < n_spheres; i++){
-    for (int j = 0; j < n_spheres; j++){
-      if (distance[i] > distance[j] || (distance[i] == distance[j] && i > j)){
-        new_ind[i]++;
-      }
-    }
+void sort(renderer_state_t* restrict state, const sphere_t* restrict spheres, int n_visible) {
+  if (state->n_ordered == n_visible) {
+    depth_sort_update(&state->depth_sort, state->depth, n_visible, state->order);
+  } else {
+    depth_sort(&state->depth_sort, state->depth, n_visible, state->order);
   }
-  cilk_for (int i = 0; i < n_spheres; i++){
-    spheres[new_ind[i]] = orig_spheres[i];
+  state->n_ordered = n_visible;
+  int scatter_grain = tuning_grain(TUNE_RENDER_SCATTER, n_visible);
+  cilk_for (int block = 0; block < n_visible; block += scatter_grain){
+    for (int k = block; k < min(block + scatter_grain, n_visible); k++){
+      const sphere_t* sphere = &spheres[state->visible[state->order[k]]];
+      state->sorted[k] = (render_sphere_t){sphere->pos, sphere->r, sphere->mat};
+    }
   }
-  free(distance);
-  free(new_ind);
 }
 
-void render_slice(renderer_state_t* restrict state, int* restrict bounding_region, char* restrict marks,
-const sphere_t* restrict spheres, int n_spheres, int x_low, int x_high, int y_low, int y_high){
-  for (int i = 0 ; i < n_spheres; i ++) {
-    float t = INFINITY;
-    material_t currentMat = spheres[i].mat;
+// Resolves which of spheres list[0, count), front to back, the pixels
+// [x_low, x_high) x [y_low, y_high) show, at most RENDER_TILE on a side,
+// RENDER_LANES pixels of a row at a time, into the visibility buffer.
+// Pixels no sphere covers are left alone. Only the part of each row of a
+// sphere's box that its span leaves is tested.
+//
+// A NULL list stands for every sphere, [0, count).
+//
+// Pixels already covered by a nearer sphere are kept as one bit per pixel
+// in a mask per row. Full rows are skipped outright, and once every row is
+// full nothing further back can show, so the rest of the list is too.
+void render_slice(renderer_state_t* restrict state, const int* restrict bounding_region,
+const render_sphere_t* restrict spheres, const int* restrict list, size_t count, int x_low, int x_high, int y_low, int y_high){
+  assert(x_high - x_low <= RENDER_TILE && y_high - y_low <= RENDER_TILE && RENDER_TILE <= 32);
+  render_target_t target = packet_target(state, spheres);
+  uint32_t covered[RENDER_TILE] = {0};
+  uint32_t full = x_high - x_low == 32 ? UINT32_MAX : (UINT32_C(1) << (x_high - x_low)) - 1;
+  int full_rows = 0;
+  for (size_t k = 0 ; k < count && full_rows < y_high - y_low; k ++) {
+    int i = list != NULL ? list[k] : (int)k;
     if (bounding_region[i * 4 + 2] >= x_high || bounding_region[i * 4 + 0] <= x_low) continue;
+    int x_min = max(x_low, bounding_region[i * 4 + 2]), x_max = min(x_high, bounding_region[i * 4 + 0]);
+    sphere_span_t span;
+    sphere_span_init(&span, &state->camera, &spheres[i]);
     for (int y = max(y_low, bounding_region[i * 4 + 3]); y < min(y_high, bounding_region[i * 4 + 1]); y++){
-      int row = y*state->r_spec.resolution;
-      for (int x = max(x_low, bounding_region[i * 4 + 2]); x < min(x_high, bounding_region[i * 4 + 0]); x++) {
-        if (!marks[row + x]) {
-          if (ray_sphere_intersection(&state->origin_rays[row + x], &spheres[i], &t)){
-            marks[row + x] = 1;
-            vector_t intersection = qadd(state->origin_rays[row + x].origin, scale(t, state->origin_rays[row + x].dir));
-
-            // Normal vector at intersection point, perpendicular to the surface
-            // of the sphere
-            vector_t normal = qsubtract(intersection, spheres[i].pos);
-            float n_size = qsize(normal);
-            // Note: n_size should be the radius of the sphere, which is nonzero.
-            normal = scale(1 / n_size, normal);
-
-            double red = 0;
-            double green = 0; 
-            double blue = 0; 
-
-            for (int j = 0; j < state->r_spec.n_lights; j++) {
-              light_t currentLight = state->r_spec.lights[j];
-              vector_t intersection_to_light = qsubtract(currentLight.pos, intersection);
-              if (qdot(normal, intersection_to_light) <= 0)
-                continue;
-
-              ray_t lightRay;
-              lightRay.origin = intersection;
-              lightRay.dir = scale(1 / qsize(intersection_to_light), intersection_to_light);
-
-              // Calculate Lambert diffusion
-              float lambert = qdot(lightRay.dir, normal);
-              red += (double)(currentLight.intensity.red * currentMat.diffuse.red *
-                              lambert);
-              green += (double)(currentLight.intensity.green *
-                                currentMat.diffuse.green * lambert);
-              blue += (double)(currentLight.intensity.blue * currentMat.diffuse.blue *
-                              lambert);
-              }
-              state->img[(x + y * state->r_spec.resolution) * 3 + 0] = min((float)red, 1.0);
-              state->img[(x + y * state->r_spec.resolution) * 3 + 1] = min((float)green, 1.0);
-              state->img[(x + y * state->r_spec.resolution) * 3 + 2] = min((float)blue, 1.0);
-          }
-        }
+      uint32_t* mask = &covered[y - y_low];
+      if (*mask == full) continue;
+      int x_first = x_min, x_last = x_max;
+      sphere_span_row(&span, &state->camera, y, &x_first, &x_last);
+      for (int x = x_first; x < x_last; x += RENDER_LANES) {
+        int lanes = min(RENDER_LANES, x_last - x);
+        int live = ~(*mask >> (x - x_low)) & ((1 << lanes) - 1);
+        *mask |= (uint32_t)intersect_packet(&target, i, x, y, lanes, live, state->precision) << (x - x_low);
       }
+      full_rows += *mask == full;
     }
   }
 }
 
-const float* render(renderer_state_t *state, const sphere_t *spheres, int n_spheres) {
-  if (state->copy_spheres == NULL) {
-    state->copy_spheres = clone(spheres, sizeof(sphere_t )* n_spheres);
+// Fewest rows render_tile_rows splits a tile into.
+#define TILE_MIN_ROWS 4
+
+// Pixel bounds of tile k of state->bins.
+static void tile_bounds(const renderer_state_t* state, int k, int* x_low, int* x_high, int* y_low, int* y_high) {
+  int resolution = state->r_spec.resolution;
+  *x_low = k % state->bins.tiles_x * RENDER_TILE;
+  *x_high = min(*x_low + RENDER_TILE, resolution);
+  *y_low = k / state->bins.tiles_x * RENDER_TILE;
+  *y_high = min(*y_low + RENDER_TILE, resolution);
+}
+
+// Estimated cost of drawing tile k: the spheres binned into it, plus one
+// for clearing it, times its area.
+static long tile_cost(const renderer_state_t* state, int k) {
+  int x_low, x_high, y_low, y_high;
+  tile_bounds(state, k, &x_low, &x_high, &y_low, &y_high);
+  long count = (long)(state->bins.start[k + 1] - state->bins.start[k]);
+  return (count + 1) * (x_high - x_low) * (y_high - y_low);
+}
+
+// Clears the pixels [x_low, x_high) x [y_low, y_high), at most
+// RENDER_TILE on a side, in the visibility buffer, resolves spheres
+// list[0, count) on them (see render_slice), and shades them.
+static void render_rows(renderer_state_t* restrict state, const int* restrict bounding_region,
+                        const render_sphere_t* restrict spheres, const int* restrict list, size_t count, int x_low,
+                        int x_high, int y_low, int y_high) {
+  int resolution = state->r_spec.resolution;
+  for (int y = y_low; y < y_high; y++) {
+    for (int x = x_low; x < x_high; x++) {
+      state->ids[(size_t)y * resolution + x] = -1;
+      state->hit_t[(size_t)y * resolution + x] = INFINITY;
+    }
   }
-  sphere_t* sorted_spheres = state->copy_spheres;
-  sort(state, spheres, sorted_spheres, n_spheres);
+  render_slice(state, bounding_region, spheres, list, count, x_low, x_high, y_low, y_high);
+  render_target_t target = packet_target(state, spheres);
+  shade_rows(&target, x_low, x_high, y_low, y_high, state->precision);
+}
 
-  // Compute all bounding regions in parallel
-  int* bounding_region = malloc(n_spheres * 4 * sizeof(int));
-  cilk_for (int i = 0; i < n_spheres; i++){
-    find_bounding_region(&sorted_spheres[i], state, &bounding_region[i * 4]);
-  } 
-  char* marks = calloc((size_t)state->total_pixels, sizeof(char));
-
-  // Calculate origin rays
-  cilk_for (int y = 0; y < state->r_spec.resolution; y++){
-    int row = y * state->r_spec.resolution;
-    for (int x = 0; x < state->r_spec.resolution; x++){
-      state->origin_rays[row + x] = origin_to_pixel(state, x, y);
+// Draws rows [y_low, y_high) of tile k of state->bins from the spheres
+// binned into the tile. While the rows cost more than leaf (cost is the whole tile's),
+// they are halved and the halves drawn in parallel, down to TILE_MIN_ROWS
+// rows.
+void render_tile_rows(renderer_state_t* restrict state, const int* restrict bounding_region,
+                      const render_sphere_t* restrict spheres, int k, int y_low, int y_high, long cost, long leaf) {
+  int x_low, x_high, tile_y_low, tile_y_high;
+  tile_bounds(state, k, &x_low, &x_high, &tile_y_low, &tile_y_high);
+  if (y_high - y_low >= 2 * TILE_MIN_ROWS && cost * (y_high - y_low) > leaf * (tile_y_high - tile_y_low)) {
+    int y_mid = y_low + (y_high - y_low) / 2;
+    cilk_scope {
+      cilk_spawn render_tile_rows(state, bounding_region, spheres, k, y_low, y_mid, cost, leaf);
+      render_tile_rows(state, bounding_region, spheres, k, y_mid, y_high, cost, leaf);
+    }
+    return;
+  }
+  const tile_bins_t* bins = &state->bins;
+  render_rows(state, bounding_region, spheres, &bins->spheres[bins->start[k]], bins->start[k + 1] - bins->start[k],
+              x_low, x_high, y_low, y_high);
+}
+
+// Draws tiles [lo, hi), where cost[k] is the estimated cost of tiles
+// [0, k). Ranges that cost more than leaf are split where their cost
+// halves and the halves drawn in parallel, and single tiles that do are
+// split by rows, so clusters of spheres get as many strands as they need
+// wherever they are on screen.
+void render_tile_range(renderer_state_t* restrict state, const int* restrict bounding_region,
+                       const render_sphere_t* restrict spheres, const long* restrict cost, int lo, int hi,
+                       long leaf) {
+  if (hi - lo > 1 && cost[hi] - cost[lo] > leaf) {
+    long half = cost[lo] + (cost[hi] - cost[lo]) / 2;
+    int low = lo + 1, high = hi - 1;
+    while (low < high) {
+      int mid = low + (high - low) / 2;
+      if (cost[mid] < half) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    cilk_scope {
+      cilk_spawn render_tile_range(state, bounding_region, spheres, cost, lo, low, leaf);
+      render_tile_range(state, bounding_region, spheres, cost, low, hi, leaf);
+    }
+    return;
+  }
+  for (int k = lo; k < hi; k++) {
+    int x_low, x_high, y_low, y_high;
+    tile_bounds(state, k, &x_low, &x_high, &y_low, &y_high);
+    render_tile_rows(state, bounding_region, spheres, k, y_low, y_high, cost[k + 1] - cost[k], leaf);
+  }
+}
+
+// Draws every tile. The tuned grain sets how many pieces the work is cut
+// into, as for the other loops, but the pieces are cut to even out the
+// estimated cost rather than the number of tiles. If the cost table cannot
+// be allocated the pieces are cut by tile count instead.
+void render_tiles(renderer_state_t* state, const int* bounding_region, const render_sphere_t* spheres) {
+  int n_tiles = state->bins.n_tiles;
+  int grain = tuning_grain(TUNE_RENDER_TILES, n_tiles);
+  long* cost = malloc(((size_t)n_tiles + 1) * sizeof(long));
+  if (cost == NULL) {
+    cilk_for (int block = 0; block < n_tiles; block += grain){
+      for (int k = block; k < min(block + grain, n_tiles); k++){
+        int x_low, x_high, y_low, y_high;
+        tile_bounds(state, k, &x_low, &x_high, &y_low, &y_high);
+        render_tile_rows(state, bounding_region, spheres, k, y_low, y_high, 0, 1);
+      }
     }
+    return;
+  }
+  cost[0] = 0;
+  for (int k = 0; k < n_tiles; k++) {
+    cost[k + 1] = cost[k] + tile_cost(state, k);
   }
+  long leaf = max(cost[n_tiles] / n_tiles * grain, 1);
+  render_tile_range(state, bounding_region, spheres, cost, 0, n_tiles, leaf);
+  free(cost);
+}
 
+// Fallback for frames whose tile lists could not be allocated: every tile
+// walks all n_spheres spheres.
+void render_unbinned(renderer_state_t* state, const int* bounding_region, const render_sphere_t* spheres,
+                     int n_spheres) {
+  int n_tiles = state->bins.n_tiles;
+  int grain = tuning_grain(TUNE_RENDER_TILES, n_tiles);
+  cilk_for (int block = 0; block < n_tiles; block += grain){
+    for (int k = block; k < min(block + grain, n_tiles); k++){
+      int x_low, x_high, y_low, y_high;
+      tile_bounds(state, k, &x_low, &x_high, &y_low, &y_high);
+      render_rows(state, bounding_region, spheres, NULL, (size_t)n_spheres, x_low, x_high, y_low, y_high);
+    }
+  }
+}
+
+// Makes sure state->bvh has room for n_spheres spheres; false if it could
+// not be allocated, in which case the frame is rasterized instead.
+static bool bvh_ready(renderer_state_t* state, int n_spheres) {
+  if (state->bvh.nodes != NULL && state->bvh.capacity >= n_spheres) {
+    return true;
+  }
+  render_bvh_destroy(&state->bvh);
+  return render_bvh_init(&state->bvh, n_spheres) == 0;
+}
+
+typedef struct {
+  renderer_state_t* state;
+  const render_sphere_t* spheres;
+  const ray_t* ray;
+} trace_t;
+
+static int trace_hit(int item, void* arg, float* t) {
+  trace_t* trace = arg;
+  return ray_sphere_intersection((ray_t*)trace->ray, &trace->spheres[item], t);
+}
+
+// RENDER_VISIBILITY_BVH counterpart of the render_slice loop: finds the
+// front-most sphere each pixel's ray hits through state->bvh, which must
+// have been built over bounding_region, and shades the rows.
+void trace_rows(renderer_state_t* state, const int* bounding_region, const render_sphere_t* spheres,
+                int y_low, int y_high) {
   int resolution = state->r_spec.resolution;
-  int slice[5] = {0, resolution / 4, resolution / 4 * 2, resolution / 4 * 3, resolution};
-  cilk_scope{
-    for (int i = 0; i < 4; i++){
-      for (int j = 0; j < 4; j++){
-        cilk_spawn render_slice(state, bounding_region, marks, sorted_spheres, n_spheres, slice[i], slice[i+1], slice[j], slice[j+1]);
+  for (int y = y_low; y < y_high; y++) {
+    int row = y * resolution;
+    for (int x = 0; x < resolution; x++) {
+      ray_t ray = primary_ray(state, (size_t)(row + x));
+      trace_t trace = {state, spheres, &ray};
+      float t = INFINITY;
+      int i = render_bvh_first_hit(&state->bvh, bounding_region, x, y, trace_hit, &trace, &t);
+      state->ids[row + x] = i;
+      state->hit_t[row + x] = i >= 0 ? t : INFINITY;
+    }
+  }
+  render_target_t target = packet_target(state, spheres);
+  shade_rows(&target, 0, resolution, y_low, y_high, state->precision);
+}
+
+void trace_image(renderer_state_t* state, const int* bounding_region, const render_sphere_t* spheres) {
+  int resolution = state->r_spec.resolution;
+  int grain = tuning_grain(TUNE_RENDER_TRACE, resolution);
+  cilk_for (int block = 0; block < resolution; block += grain){
+    trace_rows(state, bounding_region, spheres, block, min(block + grain, resolution));
+  }
+}
+
+void find_bounding_regions(renderer_state_t* state, render_sphere_t* spheres, int n_spheres, int* bounding_region) {
+  int grain = tuning_grain(TUNE_RENDER_BOUNDS, n_spheres);
+  cilk_for (int block = 0; block < n_spheres; block += grain){
+    for (int i = block; i < min(block + grain, n_spheres); i++){
+      find_bounding_region(&spheres[i], state, &bounding_region[i * 4]);
+    }
+  }
+}
+
+void compute_origin_rays(renderer_state_t* state) {
+  int resolution = state->r_spec.resolution;
+  int grain = tuning_grain(TUNE_RENDER_RAYS, resolution);
+  cilk_for (int block = 0; block < resolution; block += grain){
+    for (int y = block; y < min(block + grain, resolution); y++){
+      int row = y * resolution;
+      for (int x = 0; x < resolution; x++){
+        vector_t dir = origin_to_pixel(state, x, y).dir;
+        state->ray_x[row + x] = dir.x;
+        state->ray_y[row + x] = dir.y;
+        state->ray_z[row + x] = dir.z;
       }
     }
   }
-  free(bounding_region);
-  free(marks);
+}
+
+// Frees the sort buffers and leaves capacity at 0.
+static void sort_release(renderer_state_t* state) {
+  free(state->visible);
+  free(state->depth);
+  free(state->order);
+  free(state->offsets);
+  free(state->sorted);
+  free(state->bounding_region);
+  state->visible = NULL;
+  state->depth = NULL;
+  state->order = NULL;
+  state->offsets = NULL;
+  state->sorted = NULL;
+  state->bounding_region = NULL;
+  depth_sort_destroy(&state->depth_sort);
+  state->capacity = 0;
+  state->n_ordered = 0;
+}
+
+// Makes sure the sort buffers have room for n_spheres spheres. Returns
+// nonzero, with no buffers and capacity 0, if they could not be allocated.
+static int sort_ready(renderer_state_t* state, int n_spheres) {
+  if (state->capacity > 0 && state->capacity >= n_spheres) {
+    return 0;
+  }
+  sort_release(state);
+  size_t n = (size_t)max(n_spheres, 1);
+  state->visible = malloc(n * sizeof(int));
+  state->depth = malloc(n * sizeof(float));
+  state->order = malloc(n * sizeof(int));
+  state->offsets = malloc((n + 1) * sizeof(int));
+  state->sorted = malloc(n * sizeof(render_sphere_t));
+  state->bounding_region = malloc(4 * n * sizeof(int));
+  if (state->visible == NULL || state->depth == NULL || state->order == NULL || state->offsets == NULL ||
+      state->sorted == NULL || state->bounding_region == NULL || depth_sort_init(&state->depth_sort, n_spheres) != 0) {
+    sort_release(state);
+    return 1;
+  }
+  state->capacity = (int)n;
+  return 0;
+}
+
+typedef struct {
+  renderer_state_t* state;
+  const sphere_t* spheres;
+  int n_spheres;
+  // How many spheres culling keeps; the loops after it run over those.
+  int n_visible;
+} calibration_t;
+
+static void calibrate_cull(void* arg) {
+  calibration_t* c = arg;
+  c->n_visible = cull(c->state, c->spheres, c->n_spheres);
+}
+
+// After the first run this repairs the order the run before it left
+// behind, as it would on the next frame of a scene that barely moved.
+static void calibrate_sort(void* arg) {
+  calibration_t* c = arg;
+  sort(c->state, c->spheres, c->n_visible);
+}
+
+static void calibrate_full_sort(void* arg) {
+  calibration_t* c = arg;
+  c->state->n_ordered = 0;
+  calibrate_sort(arg);
+}
+
+static void calibrate_bounds(void* arg) {
+  calibration_t* c = arg;
+  find_bounding_regions(c->state, c->state->sorted, c->n_visible, c->state->bounding_region);
+}
+
+static void calibrate_rays(void* arg) {
+  calibration_t* c = arg;
+  compute_origin_rays(c->state);
+}
+
+static void calibrate_bin(void* arg) {
+  calibration_t* c = arg;
+  tile_bins_build(&c->state->bins, c->state->bounding_region, c->n_visible);
+}
+
+static void calibrate_tiles(void* arg) {
+  calibration_t* c = arg;
+  render_tiles(c->state, c->state->bounding_region, c->state->sorted);
+}
+
+static void calibrate_trace(void* arg) {
+  calibration_t* c = arg;
+  trace_image(c->state, c->state->bounding_region, c->state->sorted);
+}
+
+// Times the render loops on the first frame's spheres to pick grains for
+// this scene (see tuning.h). Nothing the bodies write outlives the call,
+// apart from pixels the frame being rendered overwrites.
+static void calibrate_loops(renderer_state_t* state, const sphere_t* spheres, int n_spheres) {
+  calibration_t c = {
+      .state = state,
+      .spheres = spheres,
+      .n_spheres = n_spheres,
+  };
+  c.n_visible = cull(state, spheres, n_spheres);
+  tuning_calibrate(TUNE_RENDER_CULL, n_spheres, calibrate_cull, &c);
+  int n_visible = c.n_visible;
+  tuning_calibrate(TUNE_RENDER_SORT_PASS, n_visible, calibrate_full_sort, &c);
+  tuning_calibrate(TUNE_RENDER_SORT_REPAIR, n_visible, calibrate_sort, &c);
+  tuning_calibrate(TUNE_RENDER_SCATTER, n_visible, calibrate_sort, &c);
+  tuning_calibrate(TUNE_RENDER_BOUNDS, n_visible, calibrate_bounds, &c);
+  tuning_calibrate(TUNE_RENDER_RAYS, state->r_spec.resolution, calibrate_rays, &c);
+  if (state->visibility == RENDER_VISIBILITY_RASTER &&
+      tile_bins_build(&state->bins, state->bounding_region, n_visible) == 0) {
+    tuning_calibrate(TUNE_RENDER_BIN, state->bins.tiles_x, calibrate_bin, &c);
+    tuning_calibrate(TUNE_RENDER_TILES, state->bins.n_tiles, calibrate_tiles, &c);
+  }
+  if (state->visibility == RENDER_VISIBILITY_BVH && bvh_ready(state, n_visible)) {
+    render_bvh_build(&state->bvh, state->bounding_region, n_visible);
+    tuning_calibrate(TUNE_RENDER_TRACE, state->r_spec.resolution, calibrate_trace, &c);
+  }
+}
+
+// Returns NULL if the buffers for n_spheres spheres could not be
+// allocated.
+const float* render(renderer_state_t *state, const sphere_t *spheres, int n_spheres) {
+  bool first = state->capacity == 0;
+  if (sort_ready(state, n_spheres) != 0) {
+    return NULL;
+  }
+  if (first && tuning_calibrating()) {
+    calibrate_loops(state, spheres, n_spheres);
+  }
+  render_sphere_t* sorted_spheres = state->sorted;
+  int n_visible = cull(state, spheres, n_spheres);
+  sort(state, spheres, n_visible);
+
+  // Compute all bounding regions in parallel
+  int* bounding_region = state->bounding_region;
+  find_bounding_regions(state, sorted_spheres, n_visible, bounding_region);
+
+  if (!state->rays_ready) {
+    compute_origin_rays(state);
+    state->rays_ready = true;
+  }
+
+  if (state->visibility == RENDER_VISIBILITY_BVH && bvh_ready(state, n_visible)) {
+    render_bvh_build(&state->bvh, bounding_region, n_visible);
+    trace_image(state, bounding_region, sorted_spheres);
+    return state->img;
+  }
+
+  if (tile_bins_build(&state->bins, bounding_region, n_visible) == 0) {
+    render_tiles(state, bounding_region, sorted_spheres);
+  } else {
+    render_unbinned(state, bounding_region, sorted_spheres, n_visible);
+  }
   return state->img;
 }
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include "../include/render_bvh.h"
+
+#include <cilk/cilk.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/misc_utils.h"
+
+// Items per leaf, at most.
+#define BVH_LEAF_ITEMS 4
+
+// Subtrees with fewer items than this are built serially.
+#define BVH_SPAWN_ITEMS 4096
+
+// Deepest a query can go: every level at least halves the items.
+#define BVH_MAX_DEPTH 64
+
+int render_bvh_init(render_bvh_t *bvh, int n_items) {
+  memset(bvh, 0, sizeof(*bvh));
+  bvh->capacity = n_items;
+  // A subtree of c items takes at most 2c - 1 nodes.
+  bvh->nodes = malloc((size_t)max(2 * n_items - 1, 1) * sizeof(render_bvh_node_t));
+  bvh->order = malloc((size_t)max(n_items, 1) * sizeof(int));
+  if (bvh->nodes == NULL || bvh->order == NULL) {
+    render_bvh_destroy(bvh);
+    return 1;
+  }
+  return 0;
+}
+
+void render_bvh_destroy(render_bvh_t *bvh) {
+  free(bvh->nodes);
+  free(bvh->order);
+  memset(bvh, 0, sizeof(*bvh));
+}
+
+// Twice the centre of item's box along axis (0 for x, 1 for y).
+static int centre2(const int *boxes, int item, int axis) {
+  return boxes[4 * item + axis] + boxes[4 * item + 2 + axis];
+}
+
+// Rearranges order[lo, hi) so that order[mid] is where it would be if the
+// range were sorted by centre along axis, with nothing after it smaller
+// and nothing before it larger.
+static void select_median(int *order, const int *boxes, int lo, int hi, int mid, int axis) {
+  while (hi - lo > 1) {
+    int pivot = centre2(boxes, order[lo + (hi - lo) / 2], axis);
+    int i = lo, j = hi - 1;
+    while (i <= j) {
+      while (centre2(boxes, order[i], axis) < pivot) i++;
+      while (centre2(boxes, order[j], axis) > pivot) j--;
+      if (i <= j) {
+        int tmp = order[i];
+        order[i++] = order[j];
+        order[j--] = tmp;
+      }
+    }
+    if (mid <= j) {
+      hi = j + 1;
+    } else if (mid >= i) {
+      lo = i;
+    } else {
+      return;
+    }
+  }
+}
+
+static void sort_items(int *items, int count) {
+  for (int i = 1; i < count; i++) {
+    int item = items[i];
+    int j = i - 1;
+    while (j >= 0 && items[j] > item) {
+      items[j + 1] = items[j];
+      j--;
+    }
+    items[j + 1] = item;
+  }
+}
+
+// Builds the subtree over order[lo, hi) into nodes[index, index + 2 * (hi -
+// lo) - 1). Reserving every subtree's nodes up front lets the two halves
+// be built side by side.
+static void build(render_bvh_t *bvh, const int *boxes, int index, int lo, int hi) {
+  render_bvh_node_t *node = &bvh->nodes[index];
+  node->x_min = node->y_min = node->first = INT_MAX;
+  node->x_max = node->y_max = INT_MIN;
+  int cx_min = INT_MAX, cx_max = INT_MIN, cy_min = INT_MAX, cy_max = INT_MIN;
+  for (int k = lo; k < hi; k++) {
+    const int *box = &boxes[4 * bvh->order[k]];
+    node->x_max = max(node->x_max, box[0]);
+    node->y_max = max(node->y_max, box[1]);
+    node->x_min = min(node->x_min, box[2]);
+    node->y_min = min(node->y_min, box[3]);
+    node->first = min(node->first, bvh->order[k]);
+    cx_min = min(cx_min, centre2(boxes, bvh->order[k], 0));
+    cx_max = max(cx_max, centre2(boxes, bvh->order[k], 0));
+    cy_min = min(cy_min, centre2(boxes, bvh->order[k], 1));
+    cy_max = max(cy_max, centre2(boxes, bvh->order[k], 1));
+  }
+  node->start = lo;
+  node->count = hi - lo;
+  if (hi - lo <= BVH_LEAF_ITEMS) {
+    node->left = node->right = -1;
+    sort_items(&bvh->order[lo], hi - lo);
+    return;
+  }
+
+  int mid = lo + (hi - lo) / 2;
+  select_median(bvh->order, boxes, lo, hi, mid, cx_max - cx_min >= cy_max - cy_min ? 0 : 1);
+  node->left = index + 1;
+  node->right = index + 2 * (mid - lo);
+  if (hi - lo >= BVH_SPAWN_ITEMS) {
+    cilk_scope {
+      cilk_spawn build(bvh, boxes, node->left, lo, mid);
+      build(bvh, boxes, node->right, mid, hi);
+    }
+  } else {
+    build(bvh, boxes, node->left, lo, mid);
+    build(bvh, boxes, node->right, mid, hi);
+  }
+}
+
+static int box_empty(const int *box) {
+  return box[2] >= box[0] || box[3] >= box[1];
+}
+
+void render_bvh_build(render_bvh_t *bvh, const int *boxes, int n_items) {
+  int count = 0;
+  for (int i = 0; i < n_items; i++) {
+    if (!box_empty(&boxes[4 * i])) {
+      bvh->order[count++] = i;
+    }
+  }
+  bvh->n_nodes = count > 0 ? 2 * count - 1 : 0;
+  if (count > 0) {
+    build(bvh, boxes, 0, 0, count);
+  }
+}
+
+static int node_holds(const render_bvh_node_t *node, int x, int y) {
+  return x >= node->x_min && x < node->x_max && y >= node->y_min && y < node->y_max;
+}
+
+static int box_holds(const int *box, int x, int y) {
+  return x >= box[2] && x < box[0] && y >= box[3] && y < box[1];
+}
+
+int render_bvh_first_hit(const render_bvh_t *bvh, const int *boxes, int x, int y,
+                         render_bvh_hit_t hit, void *arg, float *t) {
+  if (bvh->n_nodes == 0) {
+    return -1;
+  }
+  int best = INT_MAX;
+  int stack[BVH_MAX_DEPTH];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const render_bvh_node_t *node = &bvh->nodes[stack[--top]];
+    if (node->first >= best || !node_holds(node, x, y)) {
+      continue;
+    }
+    if (node->left < 0) {
+      for (int k = node->start; k < node->start + node->count; k++) {
+        int item = bvh->order[k];
+        if (item >= best) {
+          break;
+        }
+        if (box_holds(&boxes[4 * item], x, y) && hit(item, arg, t)) {
+          best = item;
+          break;
+        }
+      }
+      continue;
+    }
+    // Visit the child with the nearer spheres first, so the other one can
+    // often be skipped.
+    const render_bvh_node_t *left = &bvh->nodes[node->left];
+    const render_bvh_node_t *right = &bvh->nodes[node->right];
+    if (left->first < right->first) {
+      stack[top++] = node->right;
+      stack[top++] = node->left;
+    } else {
+      stack[top++] = node->left;
+      stack[top++] = node->right;
+    }
+  }
+  return best == INT_MAX ? -1 : best;
+}
@@ -0,0 +1,79 @@
+#include "../include/render_cull.h"
+
+#include <math.h>
+
+// How far past the outermost pixel centres the view extends, in pixels.
+#define CULL_MARGIN 1
+
+// How much the tests enlarge a sphere's squared radius, relative to the
+// squared distance from the eye to its far side. Same reasoning as
+// SPAN_SLACK in render_span.c: the exact test decides hits from float
+// differences of squares of about that size.
+#define CULL_SLACK 1e-6
+
+static double dot3(const double *a, const double *b) {
+  return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void cross3(const double *a, const double *b, double *out) {
+  out[0] = a[1] * b[2] - a[2] * b[1];
+  out[1] = a[2] * b[0] - a[0] * b[2];
+  out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// Unnormalized direction of the ray through pixel (x, y).
+static void pixel_dir(const span_camera_t *camera, double x, double y, double *out) {
+  for (int d = 0; d < 3; d++) {
+    out[d] = camera->corner[d] + x * camera->step[d] + y * camera->row[d];
+  }
+}
+
+// Scales v to unit length, flipped if need be to point the way of towards.
+static void orient(double *v, const double *towards) {
+  double scale = 1 / sqrt(dot3(v, v));
+  if (dot3(v, towards) < 0) {
+    scale = -scale;
+  }
+  for (int d = 0; d < 3; d++) {
+    v[d] *= scale;
+  }
+}
+
+void view_frustum_init(view_frustum_t *frustum, const span_camera_t *camera, int resolution) {
+  double low = -CULL_MARGIN, high = resolution - 1 + CULL_MARGIN, middle = (resolution - 1) / 2.0;
+  double corners[4][3], centre[3];
+  pixel_dir(camera, low, low, corners[0]);
+  pixel_dir(camera, high, low, corners[1]);
+  pixel_dir(camera, high, high, corners[2]);
+  pixel_dir(camera, low, high, corners[3]);
+  pixel_dir(camera, middle, middle, centre);
+  for (int d = 0; d < 3; d++) {
+    frustum->eye[d] = camera->eye[d];
+  }
+  for (int side = 0; side < 4; side++) {
+    cross3(corners[side], corners[(side + 1) % 4], frustum->normal[side]);
+    orient(frustum->normal[side], centre);
+  }
+  for (int d = 0; d < 3; d++) {
+    frustum->normal[4][d] = centre[d];
+  }
+  orient(frustum->normal[4], centre);
+}
+
+bool view_frustum_may_show(const view_frustum_t *frustum, vector_t pos, float r) {
+  double w[3] = {pos.x - frustum->eye[0], pos.y - frustum->eye[1], pos.z - frustum->eye[2]};
+  double w_w = dot3(w, w);
+  double reach = sqrt(w_w) + fabs(r);
+  double slack = CULL_SLACK * reach * reach;
+  // The exact test never hits a sphere the eye is inside or on.
+  if (w_w < (double)r * r - slack) {
+    return false;
+  }
+  double enlarged = sqrt((double)r * r + slack);
+  for (int plane = 0; plane < 5; plane++) {
+    if (dot3(w, frustum->normal[plane]) < -enlarged) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,371 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../include/render_kernels.h"
+
+int render_lights_init(render_lights_t *lights, const renderer_spec_t *spec) {
+  memset(lights, 0, sizeof(*lights));
+  size_t n = (size_t)(spec->n_lights > 0 ? spec->n_lights : 1);
+  lights->n = spec->n_lights;
+  lights->x = malloc(6 * n * sizeof(float));
+  if (lights->x == NULL) {
+    return 1;
+  }
+  lights->y = lights->x + n;
+  lights->z = lights->y + n;
+  lights->red = lights->z + n;
+  lights->green = lights->red + n;
+  lights->blue = lights->green + n;
+  for (int j = 0; j < spec->n_lights; j++) {
+    lights->x[j] = spec->lights[j].pos.x;
+    lights->y[j] = spec->lights[j].pos.y;
+    lights->z[j] = spec->lights[j].pos.z;
+    lights->red[j] = spec->lights[j].intensity.red;
+    lights->green[j] = spec->lights[j].intensity.green;
+    lights->blue[j] = spec->lights[j].intensity.blue;
+  }
+  return 0;
+}
+
+void render_lights_destroy(render_lights_t *lights) {
+  free(lights->x);
+  memset(lights, 0, sizeof(*lights));
+}
+
+#ifndef __AVX2__
+// Runs the scalar test on every live pixel of the packet.
+static int intersect_scalar(const render_target_t *target, int id, int x, int y, int count, int live) {
+  size_t at = (size_t)y * target->spec->resolution + x;
+  int hit = 0;
+  for (int k = 0; k < count; k++) {
+    if (!(live & (1 << k))) {
+      continue;
+    }
+    ray_t ray = {target->spec->eye, {target->dir_x[at + k], target->dir_y[at + k], target->dir_z[at + k]}};
+    float t;
+    if (ray_sphere_intersection(&ray, &target->spheres[id], &t)) {
+      hit |= 1 << k;
+      target->ids[at + k] = id;
+      target->t[at + k] = t;
+    }
+  }
+  return hit;
+}
+
+// Runs the scalar shading on every pixel of the packet.
+static void shade_scalar(const render_target_t *target, int x, int y, int count) {
+  size_t at = (size_t)y * target->spec->resolution + x;
+  for (int k = 0; k < count; k++) {
+    int id = target->ids[at + k];
+    if (id < 0) {
+      memset(&target->img[3 * (at + k)], 0, 3 * sizeof(float));
+      continue;
+    }
+    ray_t ray = {target->spec->eye, {target->dir_x[at + k], target->dir_y[at + k], target->dir_z[at + k]}};
+    shade_pixel(target->spec, target->img, &target->spheres[id], &ray, target->t[at + k], x + k, y);
+  }
+}
+#endif
+
+#ifdef __AVX2__
+typedef struct {
+  __m256 x, y, z;
+} vector8_t;
+
+typedef struct {
+  __m256 red, green, blue;
+} colour8_t;
+
+// What shading reads of the spheres in a packet, one sphere per lane.
+typedef struct {
+  vector8_t pos;
+  colour8_t diffuse;
+} surface8_t;
+
+// Lanes [0, 4) and [4, 8) of v, widened to double.
+static inline __m256d low_pd(__m256 v) {
+  return _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+}
+
+static inline __m256d high_pd(__m256 v) {
+  return _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+}
+
+// Rounds the lanes of low and high back to float, low ones first.
+static inline __m256 narrow(__m256d low, __m256d high) {
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(low)), _mm256_cvtpd_ps(high), 1);
+}
+
+// The misc_utils.h operations, eight lanes at a time, rounding through
+// double exactly where they do.
+
+static inline __m256 qadd8(__m256 a, __m256 b) {
+  return narrow(_mm256_add_pd(low_pd(a), low_pd(b)), _mm256_add_pd(high_pd(a), high_pd(b)));
+}
+
+static inline __m256 qsubtract8(__m256 a, __m256 b) {
+  return narrow(_mm256_sub_pd(low_pd(a), low_pd(b)), _mm256_sub_pd(high_pd(a), high_pd(b)));
+}
+
+static inline __m256 qdot8(vector8_t u, vector8_t v) {
+  __m256 x = _mm256_mul_ps(u.x, v.x);
+  __m256 y = _mm256_mul_ps(u.y, v.y);
+  __m256 z = _mm256_mul_ps(u.z, v.z);
+  return narrow(_mm256_add_pd(_mm256_add_pd(low_pd(x), low_pd(y)), low_pd(z)),
+                _mm256_add_pd(_mm256_add_pd(high_pd(x), high_pd(y)), high_pd(z)));
+}
+
+// qsize takes the square root in double of a float; rounding that back to
+// float gives the same as sqrtf.
+static inline __m256 qsize8(vector8_t v) {
+  return _mm256_sqrt_ps(qdot8(v, v));
+}
+
+static inline vector8_t scale8(__m256 c, vector8_t v) {
+  return (vector8_t){_mm256_mul_ps(v.x, c), _mm256_mul_ps(v.y, c), _mm256_mul_ps(v.z, c)};
+}
+
+static inline vector8_t broadcast(vector_t v) {
+  return (vector8_t){_mm256_set1_ps(v.x), _mm256_set1_ps(v.y), _mm256_set1_ps(v.z)};
+}
+
+// min(a, b) from misc_utils.h: b unless a < b, so NaNs pick b.
+static inline __m256 min8(__m256 a, __m256 b) {
+  return _mm256_blendv_ps(b, a, _mm256_cmp_ps(a, b, _CMP_LT_OQ));
+}
+
+// ray_sphere_intersection for the rays from the eye along dir. Returns the
+// mask of lanes that hit, with their distances in *t.
+static int intersect_exact(const render_sphere_t *sphere, vector_t eye, vector8_t dir, __m256 *t) {
+  // Everything that only depends on the sphere is done once, in scalar.
+  vector_t dist = qsubtract(eye, sphere->pos);
+  float c = (float)((double)qdot(dist, dist) - (double)(sphere->r * sphere->r));
+  __m256d two_c = _mm256_set1_pd((double)(float)(2 * (double)c));
+
+  __m256 a = qdot8(dir, dir);
+  __m256 b = _mm256_mul_ps(_mm256_set1_ps(2), qdot8(dir, broadcast(dist)));
+  __m256 four_ac = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4), a), _mm256_set1_ps(c));
+  __m256 discr = qsubtract8(_mm256_mul_ps(b, b), four_ac);
+  __m256 sqrtdiscr = _mm256_sqrt_ps(discr);
+  __m256 two_a = _mm256_mul_ps(_mm256_set1_ps(2), a);
+
+  __m256 neg_b = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+  __m256d minus_low = _mm256_sub_pd(low_pd(neg_b), low_pd(sqrtdiscr));
+  __m256d minus_high = _mm256_sub_pd(high_pd(neg_b), high_pd(sqrtdiscr));
+  __m256d plus_low = _mm256_add_pd(low_pd(neg_b), low_pd(sqrtdiscr));
+  __m256d plus_high = _mm256_add_pd(high_pd(neg_b), high_pd(sqrtdiscr));
+
+  // Both branches, then the one b picks.
+  __m256 nonneg = min8(_mm256_div_ps(narrow(minus_low, minus_high), two_a),
+                       narrow(_mm256_div_pd(two_c, minus_low), _mm256_div_pd(two_c, minus_high)));
+  __m256 neg = min8(narrow(_mm256_div_pd(two_c, plus_low), _mm256_div_pd(two_c, plus_high)),
+                    _mm256_div_ps(narrow(plus_low, plus_high), two_a));
+  __m256 zero = _mm256_setzero_ps();
+  *t = _mm256_blendv_ps(neg, nonneg, _mm256_cmp_ps(b, zero, _CMP_GE_OQ));
+  return _mm256_movemask_ps(
+      _mm256_and_ps(_mm256_cmp_ps(discr, zero, _CMP_GE_OQ), _mm256_cmp_ps(*t, zero, _CMP_GT_OQ)));
+}
+
+// shade_pixel for the lanes in hit, into red, green and blue.
+static void shade_exact(const renderer_spec_t *spec, const render_lights_t *lights, const surface8_t *surface,
+                        vector8_t dir, __m256 t, int hit, __m256 *rgb) {
+  vector8_t ray = scale8(t, dir);
+  vector8_t intersection = {qadd8(_mm256_set1_ps(spec->eye.x), ray.x), qadd8(_mm256_set1_ps(spec->eye.y), ray.y),
+                            qadd8(_mm256_set1_ps(spec->eye.z), ray.z)};
+  vector8_t normal = {qsubtract8(intersection.x, surface->pos.x), qsubtract8(intersection.y, surface->pos.y),
+                      qsubtract8(intersection.z, surface->pos.z)};
+  normal = scale8(_mm256_div_ps(_mm256_set1_ps(1), qsize8(normal)), normal);
+
+  // Lanes facing away from a light add +0, which leaves the sums alone:
+  // they start at +0 and can never become -0.
+  __m256d sum[3][2] = {{_mm256_setzero_pd(), _mm256_setzero_pd()},
+                       {_mm256_setzero_pd(), _mm256_setzero_pd()},
+                       {_mm256_setzero_pd(), _mm256_setzero_pd()}};
+  for (int j = 0; j < lights->n; j++) {
+    vector8_t to_light = {qsubtract8(_mm256_set1_ps(lights->x[j]), intersection.x),
+                          qsubtract8(_mm256_set1_ps(lights->y[j]), intersection.y),
+                          qsubtract8(_mm256_set1_ps(lights->z[j]), intersection.z)};
+    __m256 facing = _mm256_cmp_ps(qdot8(normal, to_light), _mm256_setzero_ps(), _CMP_NLE_UQ);
+    if ((_mm256_movemask_ps(facing) & hit) == 0) {
+      continue;
+    }
+    vector8_t light_dir = scale8(_mm256_div_ps(_mm256_set1_ps(1), qsize8(to_light)), to_light);
+    __m256 lambert = qdot8(light_dir, normal);
+    __m256 colour[3] = {_mm256_mul_ps(_mm256_set1_ps(lights->red[j]), surface->diffuse.red),
+                        _mm256_mul_ps(_mm256_set1_ps(lights->green[j]), surface->diffuse.green),
+                        _mm256_mul_ps(_mm256_set1_ps(lights->blue[j]), surface->diffuse.blue)};
+    for (int k = 0; k < 3; k++) {
+      __m256 term = _mm256_and_ps(_mm256_mul_ps(colour[k], lambert), facing);
+      sum[k][0] = _mm256_add_pd(sum[k][0], low_pd(term));
+      sum[k][1] = _mm256_add_pd(sum[k][1], high_pd(term));
+    }
+  }
+  for (int k = 0; k < 3; k++) {
+    rgb[k] = min8(narrow(sum[k][0], sum[k][1]), _mm256_set1_ps(1));
+  }
+}
+
+// 1 / sqrt(x) from the hardware estimate and one Newton step.
+static inline __m256 rsqrt8(__m256 x) {
+  __m256 r = _mm256_rsqrt_ps(x);
+  __m256 half_x = _mm256_mul_ps(_mm256_set1_ps(0.5f), x);
+  return _mm256_mul_ps(r, _mm256_fnmadd_ps(half_x, _mm256_mul_ps(r, r), _mm256_set1_ps(1.5f)));
+}
+
+static inline __m256 dot8(vector8_t u, vector8_t v) {
+  return _mm256_fmadd_ps(u.x, v.x, _mm256_fmadd_ps(u.y, v.y, _mm256_mul_ps(u.z, v.z)));
+}
+
+static inline vector8_t sub8(vector8_t u, vector8_t v) {
+  return (vector8_t){_mm256_sub_ps(u.x, v.x), _mm256_sub_ps(u.y, v.y), _mm256_sub_ps(u.z, v.z)};
+}
+
+// RENDER_PRECISION_FAST counterpart of intersect_exact: the same roots,
+// in single precision.
+static int intersect_fast(const render_sphere_t *sphere, vector_t eye, vector8_t dir, __m256 *t) {
+  vector8_t dist = sub8(broadcast(eye), broadcast(sphere->pos));
+  __m256 c = _mm256_fnmadd_ps(_mm256_set1_ps(sphere->r), _mm256_set1_ps(sphere->r), dot8(dist, dist));
+  __m256 a = dot8(dir, dir);
+  __m256 b = _mm256_mul_ps(_mm256_set1_ps(2), dot8(dir, dist));
+  __m256 discr = _mm256_fmsub_ps(b, b, _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4), a), c));
+  __m256 sqrtdiscr = _mm256_sqrt_ps(discr);
+  __m256 zero = _mm256_setzero_ps();
+  // q is -b - sqrtdiscr or -b + sqrtdiscr, whichever does not cancel.
+  __m256 signed_sqrt = _mm256_blendv_ps(_mm256_xor_ps(sqrtdiscr, _mm256_set1_ps(-0.0f)), sqrtdiscr,
+                                        _mm256_cmp_ps(b, zero, _CMP_GE_OQ));
+  __m256 q = _mm256_xor_ps(_mm256_add_ps(b, signed_sqrt), _mm256_set1_ps(-0.0f));
+  *t = min8(_mm256_div_ps(q, _mm256_mul_ps(_mm256_set1_ps(2), a)),
+            _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(2), c), q));
+  return _mm256_movemask_ps(
+      _mm256_and_ps(_mm256_cmp_ps(discr, zero, _CMP_GE_OQ), _mm256_cmp_ps(*t, zero, _CMP_GT_OQ)));
+}
+
+static void shade_fast(const renderer_spec_t *spec, const render_lights_t *lights, const surface8_t *surface,
+                       vector8_t dir, __m256 t, int hit, __m256 *rgb) {
+  vector8_t eye = broadcast(spec->eye);
+  vector8_t intersection = {_mm256_fmadd_ps(dir.x, t, eye.x), _mm256_fmadd_ps(dir.y, t, eye.y),
+                            _mm256_fmadd_ps(dir.z, t, eye.z)};
+  vector8_t normal = sub8(intersection, surface->pos);
+  normal = scale8(rsqrt8(dot8(normal, normal)), normal);
+
+  __m256 sum[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+  for (int j = 0; j < lights->n; j++) {
+    vector8_t light = {_mm256_set1_ps(lights->x[j]), _mm256_set1_ps(lights->y[j]), _mm256_set1_ps(lights->z[j])};
+    vector8_t to_light = sub8(light, intersection);
+    __m256 along = dot8(normal, to_light);
+    __m256 facing = _mm256_cmp_ps(along, _mm256_setzero_ps(), _CMP_NLE_UQ);
+    if ((_mm256_movemask_ps(facing) & hit) == 0) {
+      continue;
+    }
+    __m256 lambert = _mm256_and_ps(_mm256_mul_ps(along, rsqrt8(dot8(to_light, to_light))), facing);
+    sum[0] = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_set1_ps(lights->red[j]), surface->diffuse.red), lambert, sum[0]);
+    sum[1] = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_set1_ps(lights->green[j]), surface->diffuse.green), lambert,
+                             sum[1]);
+    sum[2] = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_set1_ps(lights->blue[j]), surface->diffuse.blue), lambert,
+                             sum[2]);
+  }
+  for (int k = 0; k < 3; k++) {
+    rgb[k] = min8(sum[k], _mm256_set1_ps(1));
+  }
+}
+
+// Lanes [0, count) as a mask vector.
+static inline __m256i first_lanes(int count) {
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+// The lanes whose bits are set in bits, as a mask vector.
+static inline __m256i lanes_of(int bits) {
+  __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), lane_bits), lane_bits);
+}
+
+static vector8_t load_dirs(const render_target_t *target, size_t at, int count) {
+  __m256i lanes = first_lanes(count);
+  return (vector8_t){_mm256_maskload_ps(target->dir_x + at, lanes), _mm256_maskload_ps(target->dir_y + at, lanes),
+                     _mm256_maskload_ps(target->dir_z + at, lanes)};
+}
+#endif
+
+int intersect_packet(const render_target_t *target, int id, int x, int y, int count, int live,
+                     render_precision_e precision) {
+#ifdef __AVX2__
+  if (live == 0) {
+    return 0;
+  }
+
+  const renderer_spec_t *spec = target->spec;
+  const render_sphere_t *sphere = &target->spheres[id];
+  size_t at = (size_t)y * spec->resolution + x;
+  vector8_t dir = load_dirs(target, at, count);
+  __m256 t;
+  int hit = live & (precision == RENDER_PRECISION_FAST ? intersect_fast(sphere, spec->eye, dir, &t)
+                                                       : intersect_exact(sphere, spec->eye, dir, &t));
+  if (hit != 0) {
+    __m256i lanes = lanes_of(hit);
+    _mm256_maskstore_epi32(target->ids + at, lanes, _mm256_set1_epi32(id));
+    _mm256_maskstore_ps(target->t + at, lanes, t);
+  }
+  return hit;
+#else
+  (void)precision;
+  return intersect_scalar(target, id, x, y, count, live);
+#endif
+}
+
+void shade_packet(const render_target_t *target, int x, int y, int count, render_precision_e precision) {
+#ifdef __AVX2__
+  const renderer_spec_t *spec = target->spec;
+  size_t at = (size_t)y * spec->resolution + x;
+
+  // Gathers the sphere of every lane that shows one; the rest are left
+  // at 0 and come out black.
+  float gathered[6][RENDER_LANES] = {{0}};
+  int shown = 0;
+  for (int k = 0; k < count; k++) {
+    int id = target->ids[at + k];
+    if (id < 0) {
+      continue;
+    }
+    const render_sphere_t *sphere = &target->spheres[id];
+    shown |= 1 << k;
+    gathered[0][k] = sphere->pos.x;
+    gathered[1][k] = sphere->pos.y;
+    gathered[2][k] = sphere->pos.z;
+    gathered[3][k] = sphere->mat.diffuse.red;
+    gathered[4][k] = sphere->mat.diffuse.green;
+    gathered[5][k] = sphere->mat.diffuse.blue;
+  }
+  float out[3][RENDER_LANES] = {{0}};
+  if (shown != 0) {
+    surface8_t surface = {
+        {_mm256_loadu_ps(gathered[0]), _mm256_loadu_ps(gathered[1]), _mm256_loadu_ps(gathered[2])},
+        {_mm256_loadu_ps(gathered[3]), _mm256_loadu_ps(gathered[4]), _mm256_loadu_ps(gathered[5])},
+    };
+    vector8_t dir = load_dirs(target, at, count);
+    __m256i lanes = lanes_of(shown);
+    __m256 t = _mm256_maskload_ps(target->t + at, lanes);
+    __m256 rgb[3];
+    if (precision == RENDER_PRECISION_FAST) {
+      shade_fast(spec, target->lights, &surface, dir, t, shown, rgb);
+    } else {
+      shade_exact(spec, target->lights, &surface, dir, t, shown, rgb);
+    }
+    for (int c = 0; c < 3; c++) {
+      _mm256_storeu_ps(out[c], _mm256_and_ps(rgb[c], _mm256_castsi256_ps(lanes)));
+    }
+  }
+  for (int k = 0; k < count; k++) {
+    target->img[3 * (at + k) + 0] = out[0][k];
+    target->img[3 * (at + k) + 1] = out[1][k];
+    target->img[3 * (at + k) + 2] = out[2][k];
+  }
+#else
+  (void)precision;
+  shade_scalar(target, x, y, count);
+#endif
+}
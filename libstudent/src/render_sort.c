@@ -0,0 +1,247 @@
+#include "../include/render_sort.h"
+
+#include <cilk/cilk.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/misc_utils.h"
+#include "../include/tuning.h"
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Moves per item, on average over a block, that depth_sort_update allows
+// itself before falling back to a full sort.
+#define DEPTH_SORT_SHIFTS 4
+
+// Most blocks a pass cuts the keys into. Coarser blocks only change how
+// the work is split, never the order, so grains too fine for this are
+// raised to fit.
+#define DEPTH_SORT_MAX_BLOCKS 1024
+
+int depth_sort_init(depth_sort_t *sort, int n_keys) {
+  memset(sort, 0, sizeof(*sort));
+  size_t n = (size_t)max(n_keys, 1);
+  sort->capacity = n_keys;
+  sort->keys = malloc(n * sizeof(uint64_t));
+  sort->keys_tmp = malloc(n * sizeof(uint64_t));
+  sort->order_tmp = malloc(n * sizeof(int));
+  sort->max_blocks = (int)min(n, DEPTH_SORT_MAX_BLOCKS);
+  sort->counts = malloc((size_t)sort->max_blocks * RADIX_BUCKETS * sizeof(int));
+  sort->nans = malloc(((size_t)sort->max_blocks + 1) * sizeof(uint32_t));
+  sort->sorted = malloc((size_t)sort->max_blocks * sizeof(bool));
+  if (sort->keys == NULL || sort->keys_tmp == NULL || sort->order_tmp == NULL || sort->counts == NULL ||
+      sort->nans == NULL || sort->sorted == NULL) {
+    depth_sort_destroy(sort);
+    return 1;
+  }
+  return 0;
+}
+
+void depth_sort_destroy(depth_sort_t *sort) {
+  free(sort->keys);
+  free(sort->keys_tmp);
+  free(sort->order_tmp);
+  free(sort->counts);
+  free(sort->nans);
+  free(sort->sorted);
+  memset(sort, 0, sizeof(*sort));
+}
+
+// Tuned grain of loop over n keys, raised if needed so the keys make at
+// most sort->max_blocks blocks.
+static int block_grain(const depth_sort_t *sort, tune_loop_e loop, int n) {
+  return max(tuning_grain(loop, n), (n + sort->max_blocks - 1) / sort->max_blocks);
+}
+
+// Works on the bits so that -Ofast cannot assume NaNs and signed zeros
+// away.
+bool depth_sort_barrier(float key) {
+  uint32_t bits;
+  memcpy(&bits, &key, sizeof(bits));
+  return (bits & 0x7fffffff) > 0x7f800000;
+}
+
+// Integer key that orders like key within its segment, with NaNs (which
+// end their segment) after everything else.
+static uint64_t radix_key(float key, uint32_t segment) {
+  uint32_t bits;
+  memcpy(&bits, &key, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    bits = UINT32_MAX;
+  } else {
+    if ((bits & 0x7fffffff) == 0) {
+      bits = 0;
+    }
+    bits = (bits & 0x80000000) ? ~bits : bits | 0x80000000;
+  }
+  return (uint64_t)segment << 32 | bits;
+}
+
+// One stable counting pass on the digit at shift, from (keys, order) into
+// (keys_out, order_out). Every block of grain elements counts its digits
+// into counts, the counts are summed digit-major into offsets, and every
+// block then scatters its elements in order. Returns false without moving
+// anything if all elements share the digit.
+static bool radix_pass(const uint64_t *keys, const int *order, uint64_t *keys_out, int *order_out,
+                       int *counts, int n, int shift, int grain) {
+  int n_blocks = (n + grain - 1) / grain;
+  memset(counts, 0, (size_t)n_blocks * RADIX_BUCKETS * sizeof(int));
+  cilk_for (int b = 0; b < n_blocks; b++) {
+    int *count = &counts[b * RADIX_BUCKETS];
+    for (int i = b * grain; i < min((b + 1) * grain, n); i++) {
+      count[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+    }
+  }
+  int offset = 0;
+  for (int d = 0; d < RADIX_BUCKETS; d++) {
+    int total = 0;
+    for (int b = 0; b < n_blocks; b++) {
+      int c = counts[b * RADIX_BUCKETS + d];
+      counts[b * RADIX_BUCKETS + d] = offset + total;
+      total += c;
+    }
+    if (total == n) {
+      return false;
+    }
+    offset += total;
+  }
+  cilk_for (int b = 0; b < n_blocks; b++) {
+    int *next = &counts[b * RADIX_BUCKETS];
+    for (int i = b * grain; i < min((b + 1) * grain, n); i++) {
+      int to = next[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+      keys_out[to] = keys[i];
+      order_out[to] = order[i];
+    }
+  }
+  return true;
+}
+
+// Fills sort->keys with the radix keys of keys[0, n) and returns how many
+// of them are NaN.
+static uint32_t build_keys(depth_sort_t *sort, const float *keys, int n, int grain) {
+  int n_blocks = (n + grain - 1) / grain;
+
+  // Segment of every key: how many NaNs come before it.
+  uint32_t *nans = sort->nans;
+  nans[0] = 0;
+  cilk_for (int b = 0; b < n_blocks; b++) {
+    uint32_t count = 0;
+    for (int i = b * grain; i < min((b + 1) * grain, n); i++) {
+      count += depth_sort_barrier(keys[i]);
+    }
+    nans[b + 1] = count;
+  }
+  for (int b = 0; b < n_blocks; b++) {
+    nans[b + 1] += nans[b];
+  }
+  cilk_for (int b = 0; b < n_blocks; b++) {
+    uint32_t segment = nans[b];
+    for (int i = b * grain; i < min((b + 1) * grain, n); i++) {
+      sort->keys[i] = radix_key(keys[i], segment);
+      segment += depth_sort_barrier(keys[i]);
+    }
+  }
+  return nans[n_blocks];
+}
+
+void depth_sort(depth_sort_t *sort, const float *keys, int n_keys, int *order) {
+  int n = n_keys;
+  int grain = block_grain(sort, TUNE_RENDER_SORT_PASS, n);
+  uint32_t n_nans = build_keys(sort, keys, n, grain);
+  cilk_for (int i = 0; i < n; i++) {
+    order[i] = i;
+  }
+
+  // Passes over the segment bits only happen when there are NaNs.
+  uint64_t *from_keys = sort->keys, *to_keys = sort->keys_tmp;
+  int *from_order = order, *to_order = sort->order_tmp;
+  int top = n_nans > 0 ? 64 : 32;
+  for (int shift = 0; shift < top; shift += RADIX_BITS) {
+    if (radix_pass(from_keys, from_order, to_keys, to_order, sort->counts, n, shift, grain)) {
+      uint64_t *k = from_keys;
+      from_keys = to_keys;
+      to_keys = k;
+      int *o = from_order;
+      from_order = to_order;
+      to_order = o;
+    }
+  }
+  if (from_order != order) {
+    memcpy(order, from_order, (size_t)n * sizeof(int));
+  }
+}
+
+// Whether item a goes before item b. Ties on the key fall back to the
+// input order, which is what makes the sort stable.
+static bool before(const uint64_t *keys, int a, int b) {
+  return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+}
+
+// Insertion sort of order[lo, hi) that gives up once it has moved items
+// more than budget places in total. Returns whether it finished.
+static bool insertion_sort(const uint64_t *keys, int *order, int lo, int hi, long budget) {
+  for (int i = lo + 1; i < hi; i++) {
+    int item = order[i];
+    int j = i - 1;
+    while (j >= lo && before(keys, item, order[j])) {
+      order[j + 1] = order[j];
+      j--;
+    }
+    order[j + 1] = item;
+    budget -= i - 1 - j;
+    if (budget < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Merges the sorted runs order[lo, mid) and order[mid, hi) through tmp.
+static void merge_runs(const uint64_t *keys, int *order, int *tmp, int lo, int mid, int hi) {
+  if (!before(keys, order[mid], order[mid - 1])) {
+    return;
+  }
+  int i = lo, j = mid, k = lo;
+  while (i < mid && j < hi) {
+    tmp[k++] = before(keys, order[j], order[i]) ? order[j++] : order[i++];
+  }
+  while (i < mid) {
+    tmp[k++] = order[i++];
+  }
+  while (j < hi) {
+    tmp[k++] = order[j++];
+  }
+  memcpy(&order[lo], &tmp[lo], (size_t)(hi - lo) * sizeof(int));
+}
+
+void depth_sort_update(depth_sort_t *sort, const float *keys, int n_keys, int *order) {
+  int n = n_keys;
+  build_keys(sort, keys, n, block_grain(sort, TUNE_RENDER_SORT_PASS, n));
+
+  // Every block is insertion sorted on its own, which is cheap while the
+  // items have only moved a few places. A block that needs more than
+  // DEPTH_SORT_SHIFTS moves per item is taken as a sign that the order
+  // has changed too much, and the whole thing is radix sorted instead.
+  int grain = block_grain(sort, TUNE_RENDER_SORT_REPAIR, n);
+  int n_blocks = (n + grain - 1) / grain;
+  bool *sorted = sort->sorted;
+  cilk_for (int b = 0; b < n_blocks; b++) {
+    int lo = b * grain, hi = min(lo + grain, n);
+    sorted[b] = insertion_sort(sort->keys, order, lo, hi, (long)DEPTH_SORT_SHIFTS * (hi - lo));
+  }
+  for (int b = 0; b < n_blocks; b++) {
+    if (!sorted[b]) {
+      depth_sort(sort, keys, n, order);
+      return;
+    }
+  }
+
+  // Then neighbouring runs are merged pairwise, skipping pairs that are
+  // already in order.
+  for (int width = grain; width < n; width *= 2) {
+    cilk_for (int lo = 0; lo < n - width; lo += 2 * width) {
+      merge_runs(sort->keys, order, sort->order_tmp, lo, lo + width, min(lo + 2 * width, n));
+    }
+  }
+}
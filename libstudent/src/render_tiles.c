@@ -0,0 +1,93 @@
+#include "../include/render_tiles.h"
+
+#include <cilk/cilk.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/misc_utils.h"
+#include "../include/tuning.h"
+
+int tile_bins_init(tile_bins_t *bins, int resolution) {
+  memset(bins, 0, sizeof(*bins));
+  bins->resolution = resolution;
+  bins->tiles_x = (resolution + RENDER_TILE - 1) / RENDER_TILE;
+  bins->n_tiles = bins->tiles_x * bins->tiles_x;
+  bins->start = calloc((size_t)bins->n_tiles + 1, sizeof(size_t));
+  if (bins->start == NULL) {
+    return 1;
+  }
+  return 0;
+}
+
+void tile_bins_destroy(tile_bins_t *bins) {
+  free(bins->start);
+  free(bins->spheres);
+  memset(bins, 0, sizeof(*bins));
+}
+
+// Range of tile columns [*lo, *hi) box overlaps, or an empty one if the box
+// is empty or misses tile row ty. Boxes of spheres far off screen can hold
+// anything, so everything is clamped to the image first.
+static void tile_span(const tile_bins_t *bins, const int *box, int ty, int *lo, int *hi) {
+  int x_min = max(box[2], 0), x_max = min(box[0], bins->resolution);
+  int y_min = max(box[3], ty * RENDER_TILE);
+  int y_max = min(box[1], min((ty + 1) * RENDER_TILE, bins->resolution));
+  if (x_min >= x_max || y_min >= y_max) {
+    *lo = *hi = 0;
+    return;
+  }
+  *lo = x_min / RENDER_TILE;
+  *hi = (x_max - 1) / RENDER_TILE + 1;
+}
+
+int tile_bins_build(tile_bins_t *bins, const int *boxes, int n_spheres) {
+  int tiles_x = bins->tiles_x;
+  size_t *start = bins->start;
+  memset(start, 0, ((size_t)bins->n_tiles + 1) * sizeof(size_t));
+
+  // Each tile row is binned by its own strand walking every sphere in
+  // order: first counting, then, once the counts are summed into offsets,
+  // filling in. That keeps every list in drawing order without any
+  // merging.
+  int grain = tuning_grain(TUNE_RENDER_BIN, tiles_x);
+  cilk_for (int block = 0; block < tiles_x; block += grain) {
+    for (int ty = block; ty < min(block + grain, tiles_x); ty++) {
+      size_t *count = &start[ty * tiles_x + 1];
+      for (int i = 0; i < n_spheres; i++) {
+        int lo, hi;
+        tile_span(bins, &boxes[4 * i], ty, &lo, &hi);
+        for (int tx = lo; tx < hi; tx++) {
+          count[tx]++;
+        }
+      }
+    }
+  }
+  for (int k = 0; k < bins->n_tiles; k++) {
+    start[k + 1] += start[k];
+  }
+
+  size_t total = start[bins->n_tiles];
+  if (total > bins->capacity) {
+    free(bins->spheres);
+    bins->spheres = malloc(total * sizeof(int));
+    bins->capacity = bins->spheres != NULL ? total : 0;
+    if (bins->spheres == NULL) {
+      return 1;
+    }
+  }
+
+  cilk_for (int block = 0; block < tiles_x; block += grain) {
+    size_t cursor[tiles_x];
+    for (int ty = block; ty < min(block + grain, tiles_x); ty++) {
+      memcpy(cursor, &start[ty * tiles_x], tiles_x * sizeof(size_t));
+      for (int i = 0; i < n_spheres; i++) {
+        int lo, hi;
+        tile_span(bins, &boxes[4 * i], ty, &lo, &hi);
+        for (int tx = lo; tx < hi; tx++) {
+          bins->spheres[cursor[tx]++] = i;
+        }
+      }
+    }
+  }
+  return 0;
+}
@@ -2,7 +2,6 @@
  * Author: Isabel Rosa, isrosa@mit.edu
  **/
 
-#include <assert.h>
 #include <cilk/cilk.h>
 #include <math.h>
 #include <stdlib.h>
@@ -10,84 +9,387 @@
 #include <stdio.h>
 
 #include "../../common/simulate.h"
+#include "../include/candidates.h"
+#include "../include/event_log.h"
+#include "../include/fast_math.h"
 #include "../include/misc_utils.h"
+#include "../include/out_of_core.h"
+#include "../include/parareal.h"
+#include "../include/sim_kernels.h"
+#include "../include/sim_stats.h"
+#include "../include/simulate_ext.h"
+#include "../include/tuning.h"
+
+// Precision new simulators start in; build with `make SIM_FAST_MATH=1` to
+// make it SIM_PRECISION_FAST.
+#ifndef SIM_DEFAULT_PRECISION
+#define SIM_DEFAULT_PRECISION SIM_PRECISION_EXACT
+#endif
+
+typedef struct {
+  double x, y, z;
+} double_vector_t;
+
+// Working memory of update_accelerations, kept between passes so large
+// scenes do not map it afresh every ministep.
+typedef struct {
+  int n_spheres;
+  int block;
+  // Per-sphere sums.
+  double_vector_t *acc;
+  // Terms parked for the spheres of the current block column.
+  vector_t *column;
+} force_scratch_t;
+
+static int force_scratch_reserve(force_scratch_t *scratch, int n_spheres, int block);
+static void force_scratch_destroy(force_scratch_t *scratch);
 
 typedef struct simulator_state {
   simulator_spec_t s_spec;
   sphere_t *spheres;
+  sim_stats_t stats;
+  // Where resolved collisions are published, or NULL when nobody listens.
+  event_log_t *event_log;
+  // Per-sphere partial sums for the energy/momentum diagnostics, or NULL
+  // when they are turned off.
+  diag_row_t *diag_rows;
+  sim_diagnostics_t diagnostics;
+  uint64_t frame;
+  sim_precision_e precision;
+  force_scratch_t force_scratch;
+  // Only allocated in SIM_PRECISION_FAST.
+  fast_scratch_t fast_scratch;
+  // Kernels specialized for this sphere count, or NULL if there are too
+  // many spheres for them to pay off.
+  const small_kernels_t *small;
+  // Pairs that might collide, kept across frames so scans only visit those
+  // (see candidates.h). Unused by the small-scene kernels, which scan
+  // everything anyway.
+  candidate_set_t candidates;
+  bool use_candidates;
+  // Collisions resolved by the last simulate() call.
+  int frame_collisions;
+  // Non-NULL in Parareal mode.
+  parareal_t *parareal;
+  // Non-NULL for out-of-core simulators, whose spheres live in there
+  // rather than in spheres.
+  out_of_core_t *out_of_core;
 } simulator_state_t;
 
+static void calibrate_loops(simulator_state_t *state, const simulator_spec_t *spec);
+
 simulator_state_t* init_simulator(const simulator_spec_t *spec) {
   simulator_state_t *state = (simulator_state_t*)malloc(sizeof(simulator_state_t));
+  if (state == NULL) {
+    return NULL;
+  }
   state->s_spec = *spec;
   state->spheres = malloc(2 * spec->n_spheres * sizeof(sphere_t));
-  assert(state->spheres != NULL);
+  if (state->spheres == NULL && spec->n_spheres > 0) {
+    free(state);
+    return NULL;
+  }
   memcpy(state->spheres, spec->spheres, sizeof(sphere_t) * spec->n_spheres);
   memcpy(state->spheres + state->s_spec.n_spheres, spec->spheres, sizeof(sphere_t) * state->s_spec.n_spheres);
+  simulator_reset_stats(state);
+  state->event_log = NULL;
+  state->diag_rows = NULL;
+  memset(&state->diagnostics, 0, sizeof(state->diagnostics));
+  state->frame = 0;
+  state->precision = SIM_PRECISION_EXACT;
+  memset(&state->force_scratch, 0, sizeof(state->force_scratch));
+  memset(&state->fast_scratch, 0, sizeof(state->fast_scratch));
+  simulator_set_precision(state, SIM_DEFAULT_PRECISION);
+  state->small = small_kernels_for(spec->n_spheres);
+  state->use_candidates = state->small == NULL && candidates_init(&state->candidates, spec->n_spheres) == 0;
+  state->frame_collisions = 0;
+  state->parareal = NULL;
+  state->out_of_core = NULL;
+  if (tuning_calibrating() && state->small == NULL) {
+    calibrate_loops(state, spec);
+  }
   return state;
 }
 
 void destroy_simulator(simulator_state_t* state) {
-  free(state->spheres);
+  if (state->event_log != NULL) {
+    event_log_close(state->event_log);
+  }
+  free(state->diag_rows);
+  if (state->parareal != NULL) {
+    parareal_destroy(state->parareal);
+  }
+  force_scratch_destroy(&state->force_scratch);
+  fast_scratch_destroy(&state->fast_scratch);
+  if (state->use_candidates) {
+    candidates_destroy(&state->candidates);
+  }
+  if (state->out_of_core != NULL) {
+    out_of_core_destroy(state->out_of_core);
+  } else {
+    free(state->spheres);
+  }
   free(state);
 }
 
-typedef struct {
-  double x, y, z;
-} double_vector_t;
+simulator_state_t *init_simulator_out_of_core(const simulator_spec_t *spec,
+                                              const sim_out_of_core_options_t *options) {
+  out_of_core_t *ooc = out_of_core_create(spec, options);
+  if (ooc == NULL) {
+    return NULL;
+  }
+  simulator_state_t *state = calloc(1, sizeof(simulator_state_t));
+  if (state == NULL) {
+    out_of_core_destroy(ooc);
+    return NULL;
+  }
+  state->s_spec = *spec;
+  state->spheres = out_of_core_spheres(ooc);
+  simulator_reset_stats(state);
+  state->precision = SIM_DEFAULT_PRECISION;
+  state->out_of_core = ooc;
+  return state;
+}
+
+// The small-scene kernels, if state has them and they apply to its
+// precision.
+inline __attribute__((always_inline))
+static const small_kernels_t *small_kernels(const simulator_state_t *state) {
+  return state->precision == SIM_PRECISION_EXACT ? state->small : NULL;
+}
+
+// Largest block side update_accelerations uses, which bounds its column
+// buffer to FORCE_MAX_BLOCK terms per sphere.
+#define FORCE_MAX_BLOCK 128
 
-void update_accelerations(sphere_t *spheres, int n_spheres, double g) {
-  double* buffer = calloc(3ull * (size_t) n_spheres * (size_t) n_spheres, sizeof(double));
-  cilk_for (int i = 0; i < n_spheres; i++){
-    for (int j = i + 1; j < n_spheres; j++){
-        vector_t j_minus_i = qsubtract(spheres[j].pos, spheres[i].pos);
-        double mag = qsize(j_minus_i);
-        double mag3 = mag * mag * mag;
-        float i_term = g * spheres[j].mass / mag3;
-        float j_term = g * spheres[i].mass / mag3;
-        int i_index = i * n_spheres * 3 + j * 3;
-        int j_index = j * n_spheres * 3 + i * 3;
-        buffer[i_index] += i_term * j_minus_i.x;
-        buffer[i_index + 1] += i_term * j_minus_i.y;
-        buffer[i_index + 2] += i_term * j_minus_i.z;
-        buffer[j_index] -= j_term * j_minus_i.x;
-        buffer[j_index + 1] -= j_term * j_minus_i.y;
-        buffer[j_index + 2] -= j_term * j_minus_i.z;
-    }
-  }
-  cilk_for (int i = 0; i < n_spheres; i++){
-    double_vector_t tmp_vec = {0, 0, 0};
-    for (int j = 0; j < n_spheres; j++){
-      if (i == j) continue;
-      tmp_vec.x += buffer[i * n_spheres * 3 + j * 3];
-      tmp_vec.y += buffer[i * n_spheres * 3 + j * 3 + 1];
-      tmp_vec.z += buffer[i * n_spheres * 3 + j * 3 + 2];
-    }
-    spheres[i + n_spheres].accel.x = tmp_vec.x;
-    spheres[i + n_spheres].accel.y = tmp_vec.y;
-    spheres[i + n_spheres].accel.z = tmp_vec.z;
-  }
-  free(buffer);
+// Adds the terms of pair (i, j), i < j, that sphere i gets to acc_i and
+// returns the one sphere j gets, with the same rounding the reference uses
+// for both.
+inline __attribute__((always_inline))
+static vector_t pair_terms(const sphere_t *spheres, int i, int j, double g, double_vector_t *acc_i,
+                           double *potential) {
+  vector_t j_minus_i = qsubtract(spheres[j].pos, spheres[i].pos);
+  double mag = qsize(j_minus_i);
+  double mag3 = mag * mag * mag;
+  float i_term = g * spheres[j].mass / mag3;
+  float j_term = g * spheres[i].mass / mag3;
+  acc_i->x += i_term * j_minus_i.x;
+  acc_i->y += i_term * j_minus_i.y;
+  acc_i->z += i_term * j_minus_i.z;
+  if (potential != NULL) {
+    // g * m_i * m_j / |r|, reusing the 1 / |r|^3 factor from above.
+    *potential += g * spheres[j].mass / mag3 * spheres[i].mass * mag * mag;
+  }
+  vector_t j_part = {j_term * j_minus_i.x, j_term * j_minus_i.y, j_term * j_minus_i.z};
+  return j_part;
 }
 
+inline __attribute__((always_inline))
+static void subtract_term(double_vector_t *acc, vector_t term) {
+  acc->x -= term.x;
+  acc->y -= term.y;
+  acc->z -= term.z;
+}
+
+static int force_scratch_reserve(force_scratch_t *scratch, int n_spheres, int block) {
+  int padded = (n_spheres + block - 1) / block * block;
+  if (scratch->n_spheres == n_spheres && scratch->block == block) {
+    return 0;
+  }
+  force_scratch_destroy(scratch);
+  scratch->acc = malloc((size_t)n_spheres * sizeof(double_vector_t));
+  scratch->column = malloc((size_t)padded * (size_t)block * sizeof(vector_t));
+  if (n_spheres > 0 && (scratch->acc == NULL || scratch->column == NULL)) {
+    force_scratch_destroy(scratch);
+    return 1;
+  }
+  scratch->n_spheres = n_spheres;
+  scratch->block = block;
+  return 0;
+}
+
+static void force_scratch_destroy(force_scratch_t *scratch) {
+  free(scratch->acc);
+  free(scratch->column);
+  memset(scratch, 0, sizeof(*scratch));
+}
+
+// Stores sphere i's summed acceleration into the second half of spheres,
+// and its diagnostics row if there is one.
+inline __attribute__((always_inline))
+static void store_acceleration(sphere_t *spheres, int n_spheres, int i, double_vector_t acc,
+                               diag_row_t *diag_rows) {
+  spheres[i + n_spheres].accel.x = acc.x;
+  spheres[i + n_spheres].accel.y = acc.y;
+  spheres[i + n_spheres].accel.z = acc.z;
+  if (diag_rows != NULL) {
+    vector_t vel = spheres[i].vel;
+    double mass = spheres[i].mass;
+    diag_rows[i].potential = -diag_rows[i].potential;
+    diag_rows[i].kinetic = 0.5 * mass * ((double)vel.x * vel.x + (double)vel.y * vel.y + (double)vel.z * vel.z);
+    diag_rows[i].px = mass * vel.x;
+    diag_rows[i].py = mass * vel.y;
+    diag_rows[i].pz = mass * vel.z;
+  }
+}
+
+// update_accelerations for when its scratch cannot be allocated: every
+// sphere sums its own terms in the same order, so each pair term is
+// computed twice but the results are the same.
+static void update_accelerations_unshared(sphere_t *spheres, int n_spheres, double g, diag_row_t *diag_rows) {
+  int grain = tuning_grain(TUNE_SIM_ACCUMULATE, n_spheres);
+  cilk_for (int block = 0; block < n_spheres; block += grain) {
+    for (int k = block; k < min(block + grain, n_spheres); k++) {
+      double_vector_t acc = {0, 0, 0}, unused = {0, 0, 0};
+      double *potential = NULL;
+      if (diag_rows != NULL) {
+        diag_rows[k].potential = 0;
+        potential = &diag_rows[k].potential;
+      }
+      for (int i = 0; i < k; i++) {
+        subtract_term(&acc, pair_terms(spheres, i, k, g, &unused, NULL));
+      }
+      for (int j = k + 1; j < n_spheres; j++) {
+        pair_terms(spheres, k, j, g, &acc, potential);
+      }
+      store_acceleration(spheres, n_spheres, k, acc, diag_rows);
+    }
+  }
+}
+
+// Computes the gravitational acceleration on every sphere into the second
+// half of spheres.
+//
+// Every pair term is computed once and applied to both spheres, and each
+// sphere sums its terms in double in ascending order of the other sphere,
+// as the reference does. The i < j triangle is cut into square blocks and
+// swept one block column k at a time:
+//
+// - The blocks p < k of the column run in parallel. Each adds its terms to
+//   the spheres of block p, which no other block of the column touches,
+//   and parks the terms for the spheres of block k in scratch->column.
+// - The spheres of block k then sum their parked terms in parallel, in
+//   ascending order of the other sphere.
+// - Last, the diagonal block k pairs the spheres of block k among
+//   themselves.
+//
+// Every sphere in block p thus sees its terms from columns k in ascending
+// order, and block k sees blocks 0 to k - 1 before its own, so no sum is
+// reordered. Only one column's terms are parked at a time.
+//
+// If diag_rows is non-NULL, the same pass also fills in each sphere's
+// potential, kinetic and momentum contributions for the current state. If
+// the scratch cannot be allocated, update_accelerations_unshared does the
+// same without it.
+void update_accelerations(sphere_t *spheres, int n_spheres, double g, force_scratch_t *scratch,
+                          diag_row_t *diag_rows) {
+  int block = min(tuning_grain(TUNE_SIM_FORCE, n_spheres), FORCE_MAX_BLOCK);
+  if (force_scratch_reserve(scratch, n_spheres, block) != 0) {
+    update_accelerations_unshared(spheres, n_spheres, g, diag_rows);
+    return;
+  }
+  double_vector_t *acc = scratch->acc;
+  memset(acc, 0, (size_t)n_spheres * sizeof(double_vector_t));
+  if (diag_rows != NULL) {
+    for (int i = 0; i < n_spheres; i++) {
+      diag_rows[i].potential = 0;
+    }
+  }
+
+  for (int j_lo = 0; j_lo < n_spheres; j_lo += block) {
+    int j_hi = min(j_lo + block, n_spheres);
+    // column[(j - j_lo) * j_lo + i] is sphere j's term from sphere i < j_lo.
+    vector_t *column = scratch->column;
+    cilk_for (int i_lo = 0; i_lo < j_lo; i_lo += block) {
+      for (int j = j_lo; j < j_hi; j++) {
+        for (int i = i_lo; i < i_lo + block; i++) {
+          double *potential = diag_rows != NULL ? &diag_rows[i].potential : NULL;
+          column[(size_t)(j - j_lo) * j_lo + i] = pair_terms(spheres, i, j, g, &acc[i], potential);
+        }
+      }
+    }
+    cilk_for (int j = j_lo; j < j_hi; j++) {
+      for (int i = 0; i < j_lo; i++) {
+        subtract_term(&acc[j], column[(size_t)(j - j_lo) * j_lo + i]);
+      }
+    }
+    for (int i = j_lo; i < j_hi; i++) {
+      double *potential = diag_rows != NULL ? &diag_rows[i].potential : NULL;
+      for (int j = i + 1; j < j_hi; j++) {
+        subtract_term(&acc[j], pair_terms(spheres, i, j, g, &acc[i], potential));
+      }
+    }
+  }
+
+  int accumulate_grain = tuning_grain(TUNE_SIM_ACCUMULATE, n_spheres);
+  cilk_for (int block = 0; block < n_spheres; block += accumulate_grain) {
+    for (int i = block; i < min(block + accumulate_grain, n_spheres); i++) {
+      store_acceleration(spheres, n_spheres, i, acc[i], diag_rows);
+    }
+  }
+}
+
+// Advances every sphere by t into the second half of spheres, then makes
+// the result current by copying it back into the first half. Each sphere
+// only reads its own entries, so both steps happen in one pass.
 void update_velocities_and_positions(sphere_t *spheres, int n_spheres, float t) {
-  cilk_for (int i = 0; i < n_spheres; i++) {
-    spheres[i + n_spheres].vel = qadd(spheres[i].vel, scale(t, spheres[i].accel));
-    spheres[i + n_spheres].pos = qadd(spheres[i].pos, scale(t, spheres[i].vel));
+  int grain = tuning_grain(TUNE_SIM_INTEGRATE, n_spheres);
+  cilk_for (int block = 0; block < n_spheres; block += grain) {
+    for (int i = block; i < min(block + grain, n_spheres); i++) {
+      spheres[i + n_spheres].vel = qadd(spheres[i].vel, scale(t, spheres[i].accel));
+      spheres[i + n_spheres].pos = qadd(spheres[i].pos, scale(t, spheres[i].vel));
+      spheres[i] = spheres[i + n_spheres];
+    }
+  }
+}
+
+// Gravity pass of the next ministep: computes the accelerations for the
+// current positions into the second half of spheres. It only reads the
+// first half's positions (and velocities, for diag_rows), so it can run
+// alongside the collision scans.
+//
+// If diag_rows is non-NULL, the pass also fills it in (see
+// update_accelerations).
+void compute_forces(simulator_state_t *state, diag_row_t *diag_rows) {
+  sphere_t *spheres = state->spheres;
+  int n_spheres = state->s_spec.n_spheres;
+  const small_kernels_t *small = small_kernels(state);
+
+  SIM_STATS_TIMER_START(force_start);
+  if (small != NULL) {
+    small->update_accelerations(spheres, n_spheres, state->s_spec.g, diag_rows);
+  } else if (state->precision == SIM_PRECISION_FAST) {
+    update_accelerations_fast(spheres, n_spheres, state->s_spec.g, &state->fast_scratch, diag_rows);
+  } else {
+    update_accelerations(spheres, n_spheres, state->s_spec.g, &state->force_scratch, diag_rows);
   }
+  SIM_STATS_TIMER_STOP(&state->stats, SIM_PHASE_FORCE, force_start);
 }
 
 // runs simulation for minCollisionTime timesteps
 // perform collision between spheres at indices i and j
-void do_ministep(sphere_t *spheres, int n_spheres, double g, float minCollisionTime, int i, int j) {
-  update_accelerations(spheres, n_spheres, g);
-  update_velocities_and_positions(spheres, n_spheres, minCollisionTime);
+//
+// Expects compute_forces to have run on the current state. If state has an
+// event log, the collision is published to it as happening eventTime into
+// the current frame.
+void do_ministep(simulator_state_t *state, float minCollisionTime, int i, int j, float eventTime) {
+  sphere_t *spheres = state->spheres;
+  int n_spheres = state->s_spec.n_spheres;
+  sim_stats_t *stats = &state->stats;
+  event_log_t *log = state->event_log;
+  const small_kernels_t *small = small_kernels(state);
 
-  cilk_for (int k = 0; k < n_spheres; k++) {
-    spheres[k] = spheres[k + n_spheres];
+  SIM_STATS_TIMER_START(integrate_start);
+  if (small != NULL) {
+    small->integrate(spheres, n_spheres, minCollisionTime);
+  } else if (state->precision == SIM_PRECISION_FAST) {
+    update_velocities_and_positions_fast(spheres, n_spheres, minCollisionTime);
+  } else {
+    update_velocities_and_positions(spheres, n_spheres, minCollisionTime);
   }
 
   if (i == -1 || j == -1) {
+    SIM_STATS_TIMER_STOP(stats, SIM_PHASE_INTEGRATE, integrate_start);
     return;
   }
 
@@ -99,137 +401,548 @@ void do_ministep(sphere_t *spheres, int n_spheres, double g, float minCollisionT
   float distNorm = qdot(distVec, distVec);
   vector_t velDiff = qsubtract(spheres[i].vel, spheres[j].vel);
   vector_t scaledDist = scale(qdot(velDiff, distVec) / distNorm, distVec);
+  vector_t oldVel = spheres[i].vel;
   spheres[i].vel = qsubtract(spheres[i].vel, scale(scale1, scaledDist));
   spheres[j].vel = qsubtract(spheres[j].vel, scale(-1 * scale2, scaledDist));
+
+  if (log != NULL) {
+    collision_event_t event = {
+        .frame = log->frame,
+        .time = eventTime,
+        .i = i,
+        .j = j,
+        .impulse = scale(spheres[i].mass, qsubtract(spheres[i].vel, oldVel)),
+    };
+    event_log_push(log, &event);
+  }
+  state->frame_collisions++;
+  SIM_STATS_ADD(stats, collisions, 1);
+  SIM_STATS_TIMER_STOP(stats, SIM_PHASE_INTEGRATE, integrate_start);
 }
 
-// Check if the spheres at indices i and j collide in the next
-// timeToCollision timesteps
-// 
-// If so, modifies timeToCollision to be the time until spheres i and j collide.
-int check_for_collision(sphere_t *spheres, int i, int j, float *timeToCollision) {
-  vector_t distVec = qsubtract(spheres[i].pos, spheres[j].pos);
-  float dist = qsize(distVec);
-  float sumRadii = (float)((double)spheres[i].r + (double)spheres[j].r);
+// Whether scans can restrict themselves to the candidate lists.
+inline __attribute__((always_inline))
+static bool candidates_ready(const simulator_state_t *state) {
+  return state->use_candidates && state->candidates.built;
+}
 
-  // Shift frame of reference to act like sphere i is stationary
-  // Not adjusting for acceleration because our simulation does not adjust for acceleration
-  vector_t movevec = qsubtract(spheres[j].vel, spheres[i].vel);
+// check_for_collision in the precision state was set up with.
+inline __attribute__((always_inline))
+static int check_pair(const simulator_state_t *state, int i, int j, float *timeToCollision, scan_counts_t *counts) {
+  if (state->precision == SIM_PRECISION_FAST) {
+    return check_for_collision_fast(state->spheres, i, j, timeToCollision, counts);
+  }
+  return check_for_collision(state->spheres, i, j, timeToCollision, counts);
+}
 
-  // Distance that sphere j moves in timeToCollision time
-  float moveDist = (float)((double)qsize(movevec) * (double)*timeToCollision);
+// Checks sphere i against others[0, count) in that order, or against the
+// spheres [lo, hi) if others is NULL, keeping the earliest collision in
+// collisionTimes[i] and collideWith[i] like a check_pair loop would.
+static void sweep_pairs(const simulator_state_t *state, int i, const int *others, int count,
+                        int lo, int hi, float *collisionTimes, int *collideWith,
+                        scan_counts_t *counts) {
+  if (state->precision == SIM_PRECISION_EXACT) {
+    if (others != NULL) {
+      sweep_collisions(state->spheres, i, others, count, &collisionTimes[i], &collideWith[i], counts);
+    } else {
+      sweep_collision_range(state->spheres, i, lo, hi, &collisionTimes[i], &collideWith[i], counts);
+    }
+    return;
+  }
+  if (others == NULL) {
+    count = hi - lo;
+  }
+  for (int k = 0; k < count; k++) {
+    int j = others != NULL ? others[k] : lo + k;
+    if (j != i && check_pair(state, i, j, &collisionTimes[i], counts)){
+      collideWith[i] = j;
+    }
+  }
+}
 
-  // Break if the length the sphere moves in timeToCollision time is less than
-  // distance between the centers of these spheres minus their radii
-  if ((double)moveDist < (double)dist - (double)sumRadii ||
-      (movevec.x == 0 && movevec.y == 0 && movevec.z == 0)) {
-    return 0;
+// Recomputes the earliest collision of sphere i with any other sphere
+// within timeLeft.
+void rescan_collisions(simulator_state_t *state, int i, float timeLeft, float *collisionTimes,
+                       int *collideWith, scan_counts_t *counts) {
+  const small_kernels_t *small = small_kernels(state);
+  collisionTimes[i] = timeLeft;
+  if (small != NULL) {
+    small->rescan(state->spheres, state->s_spec.n_spheres, i, collisionTimes, collideWith, counts);
+    return;
   }
+  if (candidates_ready(state)) {
+    const candidate_list_t *list = &state->candidates.lists[i];
+    sweep_pairs(state, i, list->adj, list->deg, 0, 0, collisionTimes, collideWith, counts);
+    return;
+  }
+  sweep_pairs(state, i, NULL, 0, 0, state->s_spec.n_spheres, collisionTimes, collideWith, counts);
+}
 
-  vector_t unitMovevec = scale(1 / qsize(movevec), movevec);
+// Rescans both spheres of a collision that was just resolved. Each rescan
+// only writes its own sphere's entries, so the two run side by side.
+static void rescan_colliders(simulator_state_t *state, int i, int j, float timeLeft,
+                             float *collisionTimes, int *collideWith, scan_counts_t *counts) {
+  SIM_STATS_TIMER_START(rescan_start);
+  if (small_kernels(state) != NULL) {
+    rescan_collisions(state, i, timeLeft, collisionTimes, collideWith, counts);
+    rescan_collisions(state, j, timeLeft, collisionTimes, collideWith, counts);
+  } else {
+    scan_counts_t j_counts = {0, 0};
+    cilk_scope {
+      cilk_spawn rescan_collisions(state, i, timeLeft, collisionTimes, collideWith, counts);
+      rescan_collisions(state, j, timeLeft, collisionTimes, collideWith, &j_counts);
+    }
+    SIM_STATS_FLUSH(&state->stats, &j_counts);
+  }
+  SIM_STATS_TIMER_STOP(&state->stats, SIM_PHASE_RESCAN, rescan_start);
+}
 
-  // distAlongMovevec = ||distVec|| * cos(angle between unitMovevec and distVec)
-  float distAlongMovevec = qdot(unitMovevec, distVec);
+// Brings the candidate lists up to date with the current state. Must run
+// before any scan that relies on them.
+static void update_candidates(simulator_state_t *state, float horizon) {
+  if (state->use_candidates) {
+    int refreshed = candidates_update(&state->candidates, state->spheres, horizon);
+    if (refreshed < 0) {
+      // Out of memory for the lists: scan every pair from now on.
+      candidates_destroy(&state->candidates);
+      state->use_candidates = false;
+      return;
+    }
+    SIM_STATS_ADD(&state->stats, candidate_refreshes, refreshed);
+    (void)refreshed;
+  }
+}
 
-  // Check that sphere j is moving towards sphere i
-  if (distAlongMovevec <= 0) {
-    return 0;
+// Fills in, for every sphere i, the earliest collision within timeStep with
+// some j > i.
+void scan_collisions(simulator_state_t *state, float timeStep, float *collisionTimes, int *collideWith) {
+  int n_spheres = state->s_spec.n_spheres;
+  int grain = tuning_grain(TUNE_SIM_SCAN, n_spheres);
+  cilk_for (int block = 0; block < n_spheres; block += grain) {
+    scan_counts_t counts = {0, 0};
+    for (int i = block; i < min(block + grain, n_spheres); i++) {
+      collisionTimes[i] = timeStep;
+      if (candidates_ready(state)) {
+        const candidate_list_t *list = &state->candidates.lists[i];
+        int above = candidate_list_find(list, i + 1);
+        sweep_pairs(state, i, list->adj + above, list->deg - above, 0, 0, collisionTimes,
+                    collideWith, &counts);
+        continue;
+      }
+      sweep_pairs(state, i, NULL, 0, i + 1, n_spheres, collisionTimes, collideWith, &counts);
+    }
+    SIM_STATS_FLUSH(&state->stats, &counts);
   }
+}
 
-  float jToMovevecDistSq =
-      (float)((double)(dist * dist) -
-              (double)(distAlongMovevec * distAlongMovevec));
+static void timed_scan(simulator_state_t *state, float timeStep, float *collisionTimes, int *collideWith) {
+  SIM_STATS_TIMER_START(scan_start);
+  update_candidates(state, timeStep);
+  scan_collisions(state, timeStep, collisionTimes, collideWith);
+  SIM_STATS_TIMER_STOP(&state->stats, SIM_PHASE_SCAN, scan_start);
+}
 
-  // Break if the closest that sphere j will get to sphere i is more than
-  // the sum of their radii
-  float sumRadiiSquared = sumRadii * sumRadii;
-  if (jToMovevecDistSq >= sumRadiiSquared) {
-    return 0;
+typedef struct {
+  float time;
+  int index;
+} next_event_t;
+
+// Advances collisionTimes[lo, hi) by elapsed, except for the entries of
+// skip1 and skip2, and returns the earliest collision among them that is
+// positive and sooner than limit, breaking ties towards the lower index.
+// index is -1 if there is none.
+//
+// That is exactly what a serial sweep over the table finds, so the search
+// can be split into independent blocks and the blocks' answers merged in
+// any order.
+static next_event_t select_next_event(float *collisionTimes, int lo, int hi, float limit,
+                                      float elapsed, int skip1, int skip2, int grain) {
+  if (hi - lo > grain) {
+    int mid = lo + (hi - lo) / 2;
+    next_event_t left = cilk_spawn select_next_event(collisionTimes, lo, mid, limit, elapsed,
+                                                     skip1, skip2, grain);
+    next_event_t right = select_next_event(collisionTimes, mid, hi, limit, elapsed, skip1, skip2,
+                                           grain);
+    cilk_sync;
+    return right.time < left.time ? right : left;
   }
+  next_event_t next = {limit, -1};
+  for (int i = lo; i < hi; i++) {
+    if (i != skip1 && i != skip2) {
+      collisionTimes[i] -= elapsed;
+    }
+    if (collisionTimes[i] < next.time && collisionTimes[i] > 0) {
+      next.time = collisionTimes[i];
+      next.index = i;
+    }
+  }
+  return next;
+}
 
-  // We now have jToMovevecDistSq and sumRadii, two sides of a right triangle.
-  // Use these to find the third side, sqrt(T)
-  float extraDist = (float)((double)sumRadiiSquared - (double)jToMovevecDistSq);
+typedef struct {
+  simulator_state_t *state;
+  float *collisionTimes;
+  int *collideWith;
+} calibration_t;
 
-  // Draw out the spheres to check why this is the distance sphere j moves
-  // before hitting sphere i;)
-  float distance = (float)((double)distAlongMovevec - (double)sqrt(extraDist));
+static void calibrate_scan(void *arg) {
+  calibration_t *c = arg;
+  scan_collisions(c->state, 1, c->collisionTimes, c->collideWith);
+}
 
-  // Break if the distance sphere j has to move to touch sphere i is too big
-  if (distance < 0 || moveDist < distance) {
-    return 0;
-  }
+static void calibrate_force(void *arg) {
+  calibration_t *c = arg;
+  update_accelerations(c->state->spheres, c->state->s_spec.n_spheres, c->state->s_spec.g,
+                       &c->state->force_scratch, NULL);
+}
+
+static void calibrate_select(void *arg) {
+  calibration_t *c = arg;
+  int n_spheres = c->state->s_spec.n_spheres;
+  select_next_event(c->collisionTimes, 0, n_spheres, 1, 0, -1, -1,
+                    tuning_grain(TUNE_SIM_SELECT, n_spheres));
+}
+
+static void calibrate_integrate(void *arg) {
+  calibration_t *c = arg;
+  update_velocities_and_positions(c->state->spheres, c->state->s_spec.n_spheres, 0);
+}
 
-  *timeToCollision = distance / qsize(movevec);
-  return 1;
+// Times the generic kernels' loops on the initial spheres to pick grains
+// for this scene size (see tuning.h). The bodies only write scratch space
+// and sphere state that is reset afterwards.
+static void calibrate_loops(simulator_state_t *state, const simulator_spec_t *spec) {
+  int n_spheres = spec->n_spheres;
+  calibration_t c = {
+      .state = state,
+      .collisionTimes = malloc((size_t)n_spheres * sizeof(float)),
+      .collideWith = malloc((size_t)n_spheres * sizeof(int)),
+  };
+  if (c.collisionTimes != NULL && c.collideWith != NULL) {
+    tuning_calibrate(TUNE_SIM_SCAN, n_spheres, calibrate_scan, &c);
+    // Advancing by 0 leaves the table the scan filled in as it was.
+    tuning_calibrate(TUNE_SIM_SELECT, n_spheres, calibrate_select, &c);
+  }
+  tuning_calibrate_max(TUNE_SIM_FORCE, n_spheres, FORCE_MAX_BLOCK, calibrate_force, &c);
+  tuning_calibrate(TUNE_SIM_ACCUMULATE, n_spheres, calibrate_force, &c);
+  tuning_calibrate(TUNE_SIM_INTEGRATE, n_spheres, calibrate_integrate, &c);
+  memcpy(state->spheres, spec->spheres, sizeof(sphere_t) * n_spheres);
+  memcpy(state->spheres + n_spheres, spec->spheres, sizeof(sphere_t) * n_spheres);
+  free(c.collisionTimes);
+  free(c.collideWith);
+  simulator_reset_stats(state);
 }
 
+// Runs the ministeps of one frame. Expects the collision table to be filled
+// in and compute_forces to have run on the current state.
+//
+// Collision prediction assumes constant velocities, so it never needs the
+// accelerations. After each collision the colliders' rescans therefore run
+// alongside the next ministep's gravity pass instead of before it.
+//
+// Events are still handled one at a time in the serial order: every
+// ministep advances every sphere by the event's time, so spheres cannot run
+// ahead of each other without changing how their trajectories round. What
+// runs in parallel is the work around each event, namely the search for
+// the next one, the catch-up of the table and the two rescans.
 void do_timestep(simulator_state_t* state, float timeStep, float* collisionTimes, int* collideWith) {
   float timeLeft = timeStep;
+  const small_kernels_t *small = small_kernels(state);
+  sim_stats_t *stats = &state->stats;
+  scan_counts_t counts = {0, 0};
+  int n_spheres = state->s_spec.n_spheres;
+  int select_grain = small != NULL ? max(n_spheres, 1) : tuning_grain(TUNE_SIM_SELECT, n_spheres);
+  // Time of the previous ministep, which the table has not been advanced by
+  // yet, and the spheres rescanned after it, which it should not be.
+  float elapsed = 0;
+  int rescanned1 = -1;
+  int rescanned2 = -1;
+  SIM_STATS_ONLY(uint64_t ministeps = 0;)
   
   // If collisions are getting too frequent, we cut time step early
   // This allows for smoother rendering without losing accuracy
   
   while (timeLeft > 0.000001) {
-    float minCollisionTime = timeLeft;
-    int indexCollider1 = -1;
-    int indexCollider2 = -1;
-    
-    for (int i = 0; i < state->s_spec.n_spheres; i++) {
-      if (collisionTimes[i] < minCollisionTime && collisionTimes[i] > 0){
-        minCollisionTime = collisionTimes[i];
-        indexCollider1 = i;
-        indexCollider2 = collideWith[i];
-      }
-    }
+    SIM_STATS_TIMER_START(select_start);
+    next_event_t next = select_next_event(collisionTimes, 0, n_spheres, timeLeft, elapsed,
+                                          rescanned1, rescanned2, select_grain);
+    float minCollisionTime = next.time;
+    int indexCollider1 = next.index;
+    int indexCollider2 = indexCollider1 != -1 ? collideWith[indexCollider1] : -1;
     
     if (indexCollider1 != -1){
       minCollisionTime = timeLeft;
-      check_for_collision(state->spheres, indexCollider1, indexCollider2, &minCollisionTime);
-    }
-    for (int i = 0; i < state->s_spec.n_spheres; i++){
-      collisionTimes[i] -= minCollisionTime;
+      check_pair(state, indexCollider1, indexCollider2, &minCollisionTime, &counts);
     }
+    // The rest of the table catches up on this in the next search.
+    elapsed = minCollisionTime;
+    rescanned1 = indexCollider1;
+    rescanned2 = indexCollider2;
+    SIM_STATS_TIMER_STOP(stats, SIM_PHASE_SELECT, select_start);
 
-    do_ministep(state->spheres, state->s_spec.n_spheres, state->s_spec.g, minCollisionTime, indexCollider1, indexCollider2);
+    do_ministep(state, minCollisionTime, indexCollider1, indexCollider2,
+                timeStep - timeLeft + minCollisionTime);
+    SIM_STATS_ONLY(ministeps++;)
 
     timeLeft = timeLeft - minCollisionTime;
 
-    if (indexCollider1 != -1){
-      collisionTimes[indexCollider1] = timeLeft;
-      for (int j = 0; j < state->s_spec.n_spheres; j++) {
-        if (j == indexCollider1) continue;
-        if (check_for_collision(state->spheres, indexCollider1, j, &collisionTimes[indexCollider1])){
-          collideWith[indexCollider1] = j;
-        }
-      }
-      collisionTimes[indexCollider2] = timeLeft;
-      for (int j = 0; j < state->s_spec.n_spheres; j++) {
-        if (j == indexCollider2) continue;
-        if (check_for_collision(state->spheres, indexCollider2, j, &collisionTimes[indexCollider2])){
-          collideWith[indexCollider2] = j;
-        }
+    // Without a collision the ministep used up the rest of the frame. The
+    // table is dropped at the end of the frame, so rescans after the last
+    // ministep would be wasted too.
+    if (indexCollider1 == -1 || !(timeLeft > 0.000001)) {
+      break;
+    }
+    // The candidate lists must cover the post-collision state before the
+    // rescans use them.
+    update_candidates(state, timeStep);
+    if (small != NULL) {
+      rescan_colliders(state, indexCollider1, indexCollider2, timeLeft, collisionTimes, collideWith, &counts);
+      compute_forces(state, NULL);
+    } else {
+      cilk_scope {
+        cilk_spawn rescan_colliders(state, indexCollider1, indexCollider2, timeLeft, collisionTimes,
+                                    collideWith, &counts);
+        compute_forces(state, NULL);
       }
     }
-    
   }
+
+  SIM_STATS_FLUSH(stats, &counts);
+  SIM_STATS_ONLY(sim_stats_record_frame(stats, ministeps);)
+}
+
+// Folds the per-sphere rows written by the first force pass of this frame
+// into state->diagnostics.
+void sum_diagnostics(simulator_state_t *state) {
+  sim_diagnostics_t d = {.valid = true, .frame = state->frame};
+  for (int i = 0; i < state->s_spec.n_spheres; i++) {
+    d.potential += state->diag_rows[i].potential;
+    d.kinetic += state->diag_rows[i].kinetic;
+    d.momentum[0] += state->diag_rows[i].px;
+    d.momentum[1] += state->diag_rows[i].py;
+    d.momentum[2] += state->diag_rows[i].pz;
+  }
+  d.total = d.kinetic + d.potential;
+  state->diagnostics = d;
 }
 
 sphere_t* simulate(simulator_state_t* state) {
   int n_spheres = state->s_spec.n_spheres;
+  if (state->out_of_core != NULL) {
+    int collisions = out_of_core_frame(state->out_of_core);
+    if (collisions < 0) {
+      return NULL;
+    }
+    state->frame_collisions = collisions;
+    state->frame++;
+    return state->spheres;
+  }
+  if (state->parareal != NULL &&
+      parareal_next_frame(state->parareal, state->spheres, state->precision)) {
+    memcpy(state->spheres + n_spheres, state->spheres, sizeof(sphere_t) * n_spheres);
+    if (state->event_log != NULL) {
+      state->event_log->frame++;
+    }
+    state->frame++;
+    return state->spheres;
+  }
+  state->frame_collisions = 0;
   float timeStep = n_spheres > 1 ? (1 / log(n_spheres)) : 1;
-  float* collisionTimes = calloc((size_t) n_spheres, sizeof(float));
-  int* collideWith = calloc((size_t) n_spheres, sizeof(int));
-  cilk_for (int i = 0; i < state->s_spec.n_spheres; i++) {
-      collisionTimes[i] = timeStep;
-      for (int j = i+1; j < state->s_spec.n_spheres; j++) {
-        if (check_for_collision(state->spheres, i, j, &collisionTimes[i])){
-          collideWith[i] = j;
-        }
-      }
+  const small_kernels_t *small = small_kernels(state);
+  // Small scenes keep their tables on the stack.
+  float smallCollisionTimes[SIM_SMALL_MAX] = {0};
+  int smallCollideWith[SIM_SMALL_MAX] = {0};
+  float* collisionTimes = small != NULL ? smallCollisionTimes : calloc((size_t) n_spheres, sizeof(float));
+  int* collideWith = small != NULL ? smallCollideWith : calloc((size_t) n_spheres, sizeof(int));
+  // The first gravity pass sees the state the frame started from, so that
+  // is the one the diagnostics are taken from.
+  if (small != NULL) {
+    scan_counts_t counts = {0, 0};
+    SIM_STATS_TIMER_START(scan_start);
+    small->scan(state->spheres, n_spheres, timeStep, collisionTimes, collideWith, &counts);
+    SIM_STATS_FLUSH(&state->stats, &counts);
+    SIM_STATS_TIMER_STOP(&state->stats, SIM_PHASE_SCAN, scan_start);
+    compute_forces(state, state->diag_rows);
+  } else {
+    cilk_scope {
+      cilk_spawn timed_scan(state, timeStep, collisionTimes, collideWith);
+      compute_forces(state, state->diag_rows);
     }
+  }
   do_timestep(state, timeStep, collisionTimes, collideWith);
-  free(collisionTimes);
-  free(collideWith);
+  if (state->diag_rows != NULL) {
+    sum_diagnostics(state);
+  }
+  if (state->event_log != NULL) {
+    state->event_log->frame++;
+  }
+  state->frame++;
+  if (small == NULL) {
+    free(collisionTimes);
+    free(collideWith);
+  }
   return state->spheres;
 }
+
+sim_stats_t simulator_stats(const simulator_state_t *state) {
+  return state->stats;
+}
+
+void simulator_reset_stats(simulator_state_t *state) {
+  memset(&state->stats, 0, sizeof(state->stats));
+  state->stats.enabled = SIM_STATS;
+}
+
+int simulator_enable_diagnostics(simulator_state_t *state, bool enable) {
+  if (!enable) {
+    free(state->diag_rows);
+    state->diag_rows = NULL;
+    return 0;
+  }
+  if (state->diag_rows == NULL) {
+    state->diag_rows = malloc((size_t)state->s_spec.n_spheres * sizeof(diag_row_t));
+    if (state->diag_rows == NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+sim_diagnostics_t simulator_diagnostics(const simulator_state_t *state) {
+  return state->diagnostics;
+}
+
+int simulator_set_precision(simulator_state_t *state, sim_precision_e precision) {
+  if (precision == SIM_PRECISION_FAST && state->fast_scratch.capacity == 0 &&
+      fast_scratch_init(&state->fast_scratch, state->s_spec.n_spheres)) {
+    return 1;
+  }
+  state->precision = precision;
+  return 0;
+}
+
+sim_precision_e simulator_precision(const simulator_state_t *state) {
+  return state->precision;
+}
+
+// Largest distance between two points of the box bounding spheres.
+static double scene_extent(const sphere_t *spheres, int n_spheres) {
+  if (n_spheres == 0) {
+    return 0;
+  }
+  vector_t lo = spheres[0].pos, hi = spheres[0].pos;
+  for (int i = 1; i < n_spheres; i++) {
+    lo.x = min(lo.x, spheres[i].pos.x);
+    lo.y = min(lo.y, spheres[i].pos.y);
+    lo.z = min(lo.z, spheres[i].pos.z);
+    hi.x = max(hi.x, spheres[i].pos.x);
+    hi.y = max(hi.y, spheres[i].pos.y);
+    hi.z = max(hi.z, spheres[i].pos.z);
+  }
+  return qdist(lo, hi);
+}
+
+int simulator_precision_report(const simulator_spec_t *spec, int n_frames,
+                               sim_precision_error_t *errors) {
+  simulator_state_t *exact = init_simulator(spec);
+  simulator_state_t *fast = init_simulator(spec);
+  simulator_set_precision(exact, SIM_PRECISION_EXACT);
+  if (simulator_set_precision(fast, SIM_PRECISION_FAST)) {
+    destroy_simulator(exact);
+    destroy_simulator(fast);
+    return 1;
+  }
+
+  int n_spheres = spec->n_spheres;
+  for (int f = 0; f < n_frames; f++) {
+    const sphere_t *e = simulate(exact);
+    const sphere_t *a = simulate(fast);
+    sim_precision_error_t err = {.scene_extent = scene_extent(e, n_spheres)};
+    double sum_sq = 0;
+    for (int i = 0; i < n_spheres; i++) {
+      double dp = qdist(e[i].pos, a[i].pos);
+      double dv = qdist(e[i].vel, a[i].vel);
+      double speed = qsize(e[i].vel);
+      sum_sq += dp * dp;
+      err.max_pos_error = max(err.max_pos_error, dp);
+      err.max_rel_vel_error = max(err.max_rel_vel_error, speed > 0 ? dv / speed : dv);
+    }
+    err.rms_pos_error = n_spheres > 0 ? sqrt(sum_sq / n_spheres) : 0;
+    errors[f] = err;
+  }
+
+  destroy_simulator(exact);
+  destroy_simulator(fast);
+  return 0;
+}
+
+int simulator_frame_collisions(const simulator_state_t *state) {
+  return state->frame_collisions;
+}
+
+// Candidate lists are kept: spheres that jumped are just over their drift
+// budget, and get new lists on the next frame like any others.
+void simulator_restart(simulator_state_t *state, const sphere_t *spheres) {
+  int n_spheres = state->s_spec.n_spheres;
+  memcpy(state->spheres, spheres, sizeof(sphere_t) * n_spheres);
+  memcpy(state->spheres + n_spheres, spheres, sizeof(sphere_t) * n_spheres);
+  state->frame = 0;
+  state->frame_collisions = 0;
+}
+
+int simulator_enable_parareal(simulator_state_t *state, const sim_parareal_options_t *options) {
+  if (state->out_of_core != NULL) {
+    return 1;
+  }
+  parareal_t *parareal = NULL;
+  if (options != NULL) {
+    // The fine simulators start from the current spheres; the spec's may
+    // be long gone.
+    simulator_spec_t spec = state->s_spec;
+    spec.spheres = state->spheres;
+    parareal = parareal_create(&spec, options);
+    if (parareal == NULL) {
+      return 1;
+    }
+  }
+  if (state->parareal != NULL) {
+    parareal_destroy(state->parareal);
+  }
+  state->parareal = parareal;
+  return 0;
+}
+
+sim_parareal_stats_t simulator_parareal_stats(const simulator_state_t *state) {
+  sim_parareal_stats_t none = {0};
+  return state->parareal != NULL ? parareal_stats(state->parareal) : none;
+}
+
+int simulator_open_event_log(simulator_state_t *state, const char *path, size_t capacity) {
+  event_log_t *log = event_log_open(path, capacity);
+  if (log == NULL) {
+    return 1;
+  }
+  if (state->event_log != NULL) {
+    event_log_close(state->event_log);
+  }
+  state->event_log = log;
+  return 0;
+}
+
+uint64_t simulator_event_log_dropped(const simulator_state_t *state) {
+  return state->event_log == NULL ? 0 : state->event_log->dropped;
+}
+
+const char *sim_phase_name(sim_phase_e phase) {
+  static const char *const names[SIM_N_PHASES] = {
+      [SIM_PHASE_SCAN] = "scan",
+      [SIM_PHASE_SELECT] = "select",
+      [SIM_PHASE_FORCE] = "force",
+      [SIM_PHASE_INTEGRATE] = "integrate",
+      [SIM_PHASE_RESCAN] = "rescan",
+  };
+  if (phase < 0 || phase >= SIM_N_PHASES) {
+    return "unknown";
+  }
+  return names[phase];
+}
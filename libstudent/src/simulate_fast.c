@@ -0,0 +1,135 @@
+#include <cilk/cilk.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/fast_math.h"
+#include "../include/sim_kernels.h"
+
+#define FAST_LANES 8
+
+int fast_scratch_init(fast_scratch_t *scratch, int n_spheres) {
+  int capacity = (n_spheres + FAST_LANES - 1) / FAST_LANES * FAST_LANES;
+  size_t bytes = (size_t)capacity * sizeof(float);
+  scratch->capacity = capacity;
+  scratch->x = aligned_alloc(32, bytes);
+  scratch->y = aligned_alloc(32, bytes);
+  scratch->z = aligned_alloc(32, bytes);
+  scratch->gm = aligned_alloc(32, bytes);
+  if (capacity > 0 && (scratch->x == NULL || scratch->y == NULL ||
+                       scratch->z == NULL || scratch->gm == NULL)) {
+    fast_scratch_destroy(scratch);
+    return 1;
+  }
+  // The padding has no mass, so it never contributes a force.
+  memset(scratch->gm, 0, bytes);
+  return 0;
+}
+
+void fast_scratch_destroy(fast_scratch_t *scratch) {
+  free(scratch->x);
+  free(scratch->y);
+  free(scratch->z);
+  free(scratch->gm);
+  memset(scratch, 0, sizeof(*scratch));
+}
+
+// Sums g * m_j * (p_j - p_i) / |p_j - p_i|^3 over all j != i for one i,
+// along with sum of g * m_j / |p_j - p_i| for the potential.
+inline __attribute__((always_inline))
+static void accumulate_row(const fast_scratch_t *s, float xi, float yi, float zi,
+                           vector_t *accel, float *potential) {
+  float ax = 0, ay = 0, az = 0, pot = 0;
+  int j = 0;
+#ifdef __AVX2__
+  __m256 vxi = _mm256_set1_ps(xi), vyi = _mm256_set1_ps(yi), vzi = _mm256_set1_ps(zi);
+  __m256 vax = _mm256_setzero_ps(), vay = _mm256_setzero_ps();
+  __m256 vaz = _mm256_setzero_ps(), vpot = _mm256_setzero_ps();
+  for (; j < s->capacity; j += FAST_LANES) {
+    __m256 dx = _mm256_sub_ps(_mm256_load_ps(s->x + j), vxi);
+    __m256 dy = _mm256_sub_ps(_mm256_load_ps(s->y + j), vyi);
+    __m256 dz = _mm256_sub_ps(_mm256_load_ps(s->z + j), vzi);
+    __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+    // Sphere i itself (and any padding sitting on top of it) is at
+    // distance zero; mask it out instead of dividing by zero.
+    __m256 live = _mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_GT_OQ);
+    __m256 inv = _mm256_and_ps(frsqrt8(r2), live);
+    __m256 gm_inv = _mm256_mul_ps(_mm256_load_ps(s->gm + j), inv);
+    __m256 f = _mm256_mul_ps(gm_inv, _mm256_mul_ps(inv, inv));
+    vax = _mm256_fmadd_ps(f, dx, vax);
+    vay = _mm256_fmadd_ps(f, dy, vay);
+    vaz = _mm256_fmadd_ps(f, dz, vaz);
+    vpot = _mm256_add_ps(vpot, gm_inv);
+  }
+  float lanes[4][FAST_LANES];
+  _mm256_storeu_ps(lanes[0], vax);
+  _mm256_storeu_ps(lanes[1], vay);
+  _mm256_storeu_ps(lanes[2], vaz);
+  _mm256_storeu_ps(lanes[3], vpot);
+  for (int l = 0; l < FAST_LANES; l++) {
+    ax += lanes[0][l];
+    ay += lanes[1][l];
+    az += lanes[2][l];
+    pot += lanes[3][l];
+  }
+#endif
+  for (; j < s->capacity; j++) {
+    float dx = s->x[j] - xi, dy = s->y[j] - yi, dz = s->z[j] - zi;
+    float r2 = fmaf(dx, dx, fmaf(dy, dy, dz * dz));
+    if (r2 == 0) {
+      continue;
+    }
+    float inv = frsqrt(r2);
+    float gm_inv = s->gm[j] * inv;
+    float f = gm_inv * inv * inv;
+    ax = fmaf(f, dx, ax);
+    ay = fmaf(f, dy, ay);
+    az = fmaf(f, dz, az);
+    pot += gm_inv;
+  }
+  accel->x = ax;
+  accel->y = ay;
+  accel->z = az;
+  *potential = pot;
+}
+
+void update_accelerations_fast(sphere_t *spheres, int n_spheres, double g,
+                               fast_scratch_t *scratch, diag_row_t *diag_rows) {
+  cilk_for (int i = 0; i < n_spheres; i++) {
+    scratch->x[i] = spheres[i].pos.x;
+    scratch->y[i] = spheres[i].pos.y;
+    scratch->z[i] = spheres[i].pos.z;
+    scratch->gm[i] = (float)(g * spheres[i].mass);
+  }
+  // Park the padding far away so its zero mass is never multiplied by the
+  // huge 1 / r^3 of a sphere sitting right next to it. Not so far that r^2
+  // overflows, though: the Newton step in frsqrt8 turns rsqrt(inf) = 0 into
+  // inf * 0 = NaN.
+  for (int i = n_spheres; i < scratch->capacity; i++) {
+    scratch->x[i] = scratch->y[i] = scratch->z[i] = 1e18f;
+  }
+
+  cilk_for (int i = 0; i < n_spheres; i++) {
+    float potential;
+    accumulate_row(scratch, spheres[i].pos.x, spheres[i].pos.y, spheres[i].pos.z,
+                   &spheres[i + n_spheres].accel, &potential);
+    if (diag_rows != NULL) {
+      // The row visits every pair from both ends, so count half of it.
+      vector_t vel = spheres[i].vel;
+      float mass = spheres[i].mass;
+      diag_rows[i].potential = -0.5 * (double)potential * mass;
+      diag_rows[i].kinetic = 0.5 * mass * fdot(vel, vel);
+      diag_rows[i].px = mass * vel.x;
+      diag_rows[i].py = mass * vel.y;
+      diag_rows[i].pz = mass * vel.z;
+    }
+  }
+}
+
+void update_velocities_and_positions_fast(sphere_t *spheres, int n_spheres, float t) {
+  cilk_for (int i = 0; i < n_spheres; i++) {
+    spheres[i + n_spheres].vel = fadd_scaled(spheres[i].vel, t, spheres[i].accel);
+    spheres[i + n_spheres].pos = fadd_scaled(spheres[i].pos, t, spheres[i].vel);
+    spheres[i] = spheres[i + n_spheres];
+  }
+}
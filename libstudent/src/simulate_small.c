@@ -0,0 +1,163 @@
+#include "../include/misc_utils.h"
+#include "../include/sim_kernels.h"
+
+// The generic kernels in simulate.c are written for scenes with hundreds of
+// spheres. Below SIM_SMALL_MAX spheres their cilk_for loops and per-pass
+// allocations dominate, so these serial versions take over. Each kernel is
+// written once as an always-inline body taking n_spheres; instantiating it
+// with a constant count lets the compiler unroll every loop.
+
+// Gravity on every sphere, computed directly per sphere instead of through
+// the pair blocks in update_accelerations. Every pair term is rounded the
+// same way (p_j - p_i and |p_j - p_i| are symmetric in i and j), and each
+// sphere still sums its terms in double in ascending j, so the result is
+// identical.
+inline __attribute__((always_inline))
+static void small_accelerations(sphere_t *spheres, int n_spheres, double g, diag_row_t *diag_rows) {
+  for (int i = 0; i < n_spheres; i++) {
+    double ax = 0, ay = 0, az = 0;
+    double potential = 0;
+    for (int j = 0; j < n_spheres; j++) {
+      if (j == i) continue;
+      vector_t j_minus_i = qsubtract(spheres[j].pos, spheres[i].pos);
+      double mag = qsize(j_minus_i);
+      double mag3 = mag * mag * mag;
+      float term = g * spheres[j].mass / mag3;
+      ax += term * j_minus_i.x;
+      ay += term * j_minus_i.y;
+      az += term * j_minus_i.z;
+      if (diag_rows != NULL && j > i) {
+        potential += g * spheres[j].mass / mag3 * spheres[i].mass * mag * mag;
+      }
+    }
+    spheres[i + n_spheres].accel.x = ax;
+    spheres[i + n_spheres].accel.y = ay;
+    spheres[i + n_spheres].accel.z = az;
+    if (diag_rows != NULL) {
+      vector_t vel = spheres[i].vel;
+      double mass = spheres[i].mass;
+      diag_rows[i].potential = -potential;
+      diag_rows[i].kinetic = 0.5 * mass * ((double)vel.x * vel.x + (double)vel.y * vel.y + (double)vel.z * vel.z);
+      diag_rows[i].px = mass * vel.x;
+      diag_rows[i].py = mass * vel.y;
+      diag_rows[i].pz = mass * vel.z;
+    }
+  }
+}
+
+inline __attribute__((always_inline))
+static void small_integrate(sphere_t *spheres, int n_spheres, float t) {
+  for (int i = 0; i < n_spheres; i++) {
+    sphere_t *next = &spheres[i + n_spheres];
+    next->vel = qadd(spheres[i].vel, scale(t, spheres[i].accel));
+    next->pos = qadd(spheres[i].pos, scale(t, spheres[i].vel));
+    spheres[i] = *next;
+  }
+}
+
+inline __attribute__((always_inline))
+static void small_scan(const sphere_t *spheres, int n_spheres, float timeStep, float *collisionTimes,
+                       int *collideWith, scan_counts_t *counts) {
+  for (int i = 0; i < n_spheres; i++) {
+    collisionTimes[i] = timeStep;
+    for (int j = i + 1; j < n_spheres; j++) {
+      if (check_for_collision(spheres, i, j, &collisionTimes[i], counts)) {
+        collideWith[i] = j;
+      }
+    }
+  }
+}
+
+inline __attribute__((always_inline))
+static void small_rescan(const sphere_t *spheres, int n_spheres, int i, float *collisionTimes,
+                         int *collideWith, scan_counts_t *counts) {
+  for (int j = 0; j < n_spheres; j++) {
+    if (j == i) continue;
+    if (check_for_collision(spheres, i, j, &collisionTimes[i], counts)) {
+      collideWith[i] = j;
+    }
+  }
+}
+
+// Instantiates the kernels with n_spheres fixed to N.
+#define DEFINE_SMALL_KERNELS(N)                                                                  \
+  static void small_accelerations_##N(sphere_t *spheres, int n_spheres, double g,                \
+                                      diag_row_t *diag_rows) {                                   \
+    (void)n_spheres;                                                                             \
+    small_accelerations(spheres, N, g, diag_rows);                                               \
+  }                                                                                              \
+  static void small_integrate_##N(sphere_t *spheres, int n_spheres, float t) {                   \
+    (void)n_spheres;                                                                             \
+    small_integrate(spheres, N, t);                                                              \
+  }                                                                                              \
+  static void small_scan_##N(const sphere_t *spheres, int n_spheres, float timeStep,             \
+                             float *collisionTimes, int *collideWith, scan_counts_t *counts) {   \
+    (void)n_spheres;                                                                             \
+    small_scan(spheres, N, timeStep, collisionTimes, collideWith, counts);                       \
+  }                                                                                              \
+  static void small_rescan_##N(const sphere_t *spheres, int n_spheres, int i,                    \
+                               float *collisionTimes, int *collideWith, scan_counts_t *counts) { \
+    (void)n_spheres;                                                                             \
+    small_rescan(spheres, N, i, collisionTimes, collideWith, counts);                            \
+  }
+
+#define SMALL_KERNELS(N) \
+  [N] = {small_accelerations_##N, small_integrate_##N, small_scan_##N, small_rescan_##N}
+
+DEFINE_SMALL_KERNELS(1)
+DEFINE_SMALL_KERNELS(2)
+DEFINE_SMALL_KERNELS(3)
+DEFINE_SMALL_KERNELS(4)
+DEFINE_SMALL_KERNELS(5)
+DEFINE_SMALL_KERNELS(6)
+DEFINE_SMALL_KERNELS(7)
+DEFINE_SMALL_KERNELS(8)
+DEFINE_SMALL_KERNELS(9)
+DEFINE_SMALL_KERNELS(10)
+DEFINE_SMALL_KERNELS(11)
+DEFINE_SMALL_KERNELS(12)
+DEFINE_SMALL_KERNELS(13)
+DEFINE_SMALL_KERNELS(14)
+DEFINE_SMALL_KERNELS(15)
+DEFINE_SMALL_KERNELS(16)
+
+// Between SIM_SMALL_UNROLL_MAX and SIM_SMALL_MAX spheres the count stays a
+// runtime value; the kernels are still serial and allocation-free.
+static void small_accelerations_n(sphere_t *spheres, int n_spheres, double g, diag_row_t *diag_rows) {
+  small_accelerations(spheres, n_spheres, g, diag_rows);
+}
+
+static void small_integrate_n(sphere_t *spheres, int n_spheres, float t) {
+  small_integrate(spheres, n_spheres, t);
+}
+
+static void small_scan_n(const sphere_t *spheres, int n_spheres, float timeStep, float *collisionTimes,
+                         int *collideWith, scan_counts_t *counts) {
+  small_scan(spheres, n_spheres, timeStep, collisionTimes, collideWith, counts);
+}
+
+static void small_rescan_n(const sphere_t *spheres, int n_spheres, int i, float *collisionTimes,
+                           int *collideWith, scan_counts_t *counts) {
+  small_rescan(spheres, n_spheres, i, collisionTimes, collideWith, counts);
+}
+
+static const small_kernels_t unrolled_kernels[SIM_SMALL_UNROLL_MAX + 1] = {
+    SMALL_KERNELS(1),  SMALL_KERNELS(2),  SMALL_KERNELS(3),  SMALL_KERNELS(4),
+    SMALL_KERNELS(5),  SMALL_KERNELS(6),  SMALL_KERNELS(7),  SMALL_KERNELS(8),
+    SMALL_KERNELS(9),  SMALL_KERNELS(10), SMALL_KERNELS(11), SMALL_KERNELS(12),
+    SMALL_KERNELS(13), SMALL_KERNELS(14), SMALL_KERNELS(15), SMALL_KERNELS(16),
+};
+
+static const small_kernels_t serial_kernels = {
+    small_accelerations_n, small_integrate_n, small_scan_n, small_rescan_n,
+};
+
+const small_kernels_t *small_kernels_for(int n_spheres) {
+  if (n_spheres < 1 || n_spheres > SIM_SMALL_MAX) {
+    return NULL;
+  }
+  if (n_spheres <= SIM_SMALL_UNROLL_MAX) {
+    return &unrolled_kernels[n_spheres];
+  }
+  return &serial_kernels;
+}
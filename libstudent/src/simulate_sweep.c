@@ -0,0 +1,95 @@
+#include <math.h>
+#include <stdint.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../include/sim_kernels.h"
+
+#define SWEEP_LANES 8
+
+// The filter below only drops a pair if its gap, in its own single
+// precision arithmetic, clears what check_for_collision needs by this
+// fraction of the lengths involved, plus an absolute floor for lengths so
+// small that their squares go subnormal.
+#define SWEEP_REL_SLACK 1e-5f
+#define SWEEP_ABS_SLACK 1e-15f
+
+#ifdef __AVX2__
+// Lanes of j whose pairs with sphere i might get past check_for_collision's
+// first test within horizon: the ones where
+//
+//   |p_i - p_j| - (r_i + r_j) - horizon * |v_j - v_i|
+//
+// is not clearly positive. NaNs count as might.
+inline __attribute__((always_inline))
+static int maybe_colliding8(const sphere_t *spheres, const sphere_t *si, __m256i j, float horizon) {
+  const float *base = (const float *)spheres;
+  __m256i offset = _mm256_mullo_epi32(j, _mm256_set1_epi32(sizeof(sphere_t) / sizeof(float)));
+  __m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(base + 0, offset, 4), _mm256_set1_ps(si->pos.x));
+  __m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(base + 1, offset, 4), _mm256_set1_ps(si->pos.y));
+  __m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(base + 2, offset, 4), _mm256_set1_ps(si->pos.z));
+  __m256 mx = _mm256_sub_ps(_mm256_i32gather_ps(base + 3, offset, 4), _mm256_set1_ps(si->vel.x));
+  __m256 my = _mm256_sub_ps(_mm256_i32gather_ps(base + 4, offset, 4), _mm256_set1_ps(si->vel.y));
+  __m256 mz = _mm256_sub_ps(_mm256_i32gather_ps(base + 5, offset, 4), _mm256_set1_ps(si->vel.z));
+  __m256 sum_r = _mm256_add_ps(_mm256_i32gather_ps(base + 9, offset, 4), _mm256_set1_ps(si->r));
+
+  __m256 dist = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz))));
+  __m256 speed = _mm256_sqrt_ps(_mm256_fmadd_ps(mx, mx, _mm256_fmadd_ps(my, my, _mm256_mul_ps(mz, mz))));
+  __m256 move = _mm256_mul_ps(speed, _mm256_set1_ps(horizon));
+  __m256 gap = _mm256_sub_ps(_mm256_sub_ps(dist, sum_r), move);
+  __m256 slack = _mm256_fmadd_ps(_mm256_add_ps(_mm256_add_ps(dist, sum_r), move),
+                                 _mm256_set1_ps(SWEEP_REL_SLACK), _mm256_set1_ps(SWEEP_ABS_SLACK));
+  return _mm256_movemask_ps(_mm256_cmp_ps(gap, slack, _CMP_NGT_UQ));
+}
+#endif
+
+// Runs check_for_collision for i and each candidate j in order, where the
+// k-th candidate is others[k], or lo + k if others is NULL. Whole blocks of
+// SWEEP_LANES go through the filter first; the horizon only shrinks as
+// collisions are found, so filtering each block with the current one is
+// conservative.
+inline __attribute__((always_inline))
+static int sweep(const sphere_t *spheres, int i, const int *others, int lo, int count,
+                 float *timeToCollision, int *collideWith, scan_counts_t *counts) {
+  int found = 0;
+  int k = 0;
+#ifdef __AVX2__
+  const sphere_t *si = &spheres[i];
+  for (; k + SWEEP_LANES <= count; k += SWEEP_LANES) {
+    __m256i j = others != NULL
+                    ? _mm256_loadu_si256((const __m256i *)(others + k))
+                    : _mm256_add_epi32(_mm256_set1_epi32(lo + k), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    int keep = maybe_colliding8(spheres, si, j, *timeToCollision);
+    SIM_STATS_ONLY(int dropped = SWEEP_LANES - __builtin_popcount(keep);
+                   counts->calls += dropped; counts->early_rejects += dropped;)
+    while (keep != 0) {
+      int l = __builtin_ctz(keep);
+      keep &= keep - 1;
+      int jj = others != NULL ? others[k + l] : lo + k + l;
+      if (jj != i && check_for_collision(spheres, i, jj, timeToCollision, counts)) {
+        *collideWith = jj;
+        found = 1;
+      }
+    }
+  }
+#endif
+  for (; k < count; k++) {
+    int j = others != NULL ? others[k] : lo + k;
+    if (j != i && check_for_collision(spheres, i, j, timeToCollision, counts)) {
+      *collideWith = j;
+      found = 1;
+    }
+  }
+  return found;
+}
+
+int sweep_collisions(const sphere_t *spheres, int i, const int *others, int count,
+                     float *timeToCollision, int *collideWith, scan_counts_t *counts) {
+  return sweep(spheres, i, others, 0, count, timeToCollision, collideWith, counts);
+}
+
+int sweep_collision_range(const sphere_t *spheres, int i, int lo, int hi,
+                          float *timeToCollision, int *collideWith, scan_counts_t *counts) {
+  return sweep(spheres, i, NULL, lo, hi - lo, timeToCollision, collideWith, counts);
+}
@@ -0,0 +1,180 @@
+#include "../include/tuning.h"
+#include "../include/misc_utils.h"
+
+#include <cilk/cilk_api.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Default grain cap, the same one cilk_for uses.
+#define TUNING_MAX_DEFAULT_GRAIN 2048
+
+// Grains calibration tries are the powers of two up to this.
+#define TUNING_MAX_CANDIDATE 4096
+
+// Timed runs per candidate; the fastest counts.
+#define TUNING_REPS 3
+
+// 0 means the bucket has not been tuned.
+static int grains[TUNE_N_LOOPS][TUNE_N_BUCKETS];
+static bool calibrating;
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+
+static const char *const loop_names[TUNE_N_LOOPS] = {
+    [TUNE_SIM_SCAN] = "sim_scan",
+    [TUNE_SIM_FORCE] = "sim_force",
+    [TUNE_SIM_ACCUMULATE] = "sim_accumulate",
+    [TUNE_SIM_INTEGRATE] = "sim_integrate",
+    [TUNE_SIM_SELECT] = "sim_select",
+    [TUNE_RENDER_CULL] = "render_cull",
+    [TUNE_RENDER_SORT_PASS] = "render_sort_pass",
+    [TUNE_RENDER_SORT_REPAIR] = "render_sort_repair",
+    [TUNE_RENDER_SCATTER] = "render_scatter",
+    [TUNE_RENDER_BOUNDS] = "render_bounds",
+    [TUNE_RENDER_RAYS] = "render_rays",
+    [TUNE_RENDER_TRACE] = "render_trace",
+    [TUNE_RENDER_BIN] = "render_bin",
+    [TUNE_RENDER_TILES] = "render_tiles",
+};
+
+// Picks up the tuning file named by $LIBSTUDENT_TUNING, if any, so a
+// machine-specific file applies to every tool without extra flags.
+static void load_env_tuning(void) {
+  const char *path = getenv("LIBSTUDENT_TUNING");
+  if (path != NULL && path[0] != '\0' && tuning_load(path)) {
+    fprintf(stderr, "libstudent: could not load tuning file %s\n", path);
+  }
+}
+
+static int bucket_of(int n) {
+  int bucket = 0;
+  while (bucket < TUNE_N_BUCKETS - 1 && (n >> (bucket + 1)) != 0) {
+    bucket++;
+  }
+  return bucket;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int tuning_grain(tune_loop_e loop, int n) {
+  pthread_once(&env_once, load_env_tuning);
+  int grain = grains[loop][bucket_of(n)];
+  if (grain > 0) {
+    return grain;
+  }
+  // Same as cilk_for: about eight blocks per worker, capped.
+  int blocks = 8 * (int)__cilkrts_get_nworkers();
+  grain = min((n + blocks - 1) / blocks, TUNING_MAX_DEFAULT_GRAIN);
+  return max(grain, 1);
+}
+
+void tuning_calibrate(tune_loop_e loop, int n, tuning_body_t body, void *arg) {
+  tuning_calibrate_max(loop, n, TUNING_MAX_CANDIDATE, body, arg);
+}
+
+void tuning_calibrate_max(tune_loop_e loop, int n, int max_grain, tuning_body_t body, void *arg) {
+  pthread_once(&env_once, load_env_tuning);
+  int *grain = &grains[loop][bucket_of(n)];
+  if (!calibrating || *grain > 0 || n < 1) {
+    return;
+  }
+
+  int best_grain = 1;
+  uint64_t best_ns = UINT64_MAX;
+  for (int candidate = 1; candidate <= min(max_grain, TUNING_MAX_CANDIDATE); candidate *= 2) {
+    *grain = candidate;
+    for (int rep = 0; rep < TUNING_REPS; rep++) {
+      uint64_t start = now_ns();
+      body(arg);
+      uint64_t elapsed = now_ns() - start;
+      if (elapsed < best_ns) {
+        best_ns = elapsed;
+        best_grain = candidate;
+      }
+    }
+    // Past n every candidate runs the loop as one block.
+    if (candidate >= n) {
+      break;
+    }
+  }
+  *grain = best_grain;
+}
+
+void tuning_set_calibrate(bool enable) {
+  calibrating = enable;
+}
+
+bool tuning_calibrating(void) {
+  return calibrating;
+}
+
+const char *tuning_loop_name(tune_loop_e loop) {
+  if (loop < 0 || loop >= TUNE_N_LOOPS) {
+    return "unknown";
+  }
+  return loop_names[loop];
+}
+
+int tuning_load(const char *path) {
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    return 1;
+  }
+
+  int err = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), in) != NULL) {
+    char name[64];
+    long min_size;
+    int grain;
+    if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) {
+      continue;
+    }
+    if (sscanf(line, "%63s %ld %d", name, &min_size, &grain) != 3 || min_size < 1 ||
+        min_size > INT32_MAX || grain < 1) {
+      err = 1;
+      break;
+    }
+    int loop = 0;
+    while (loop < TUNE_N_LOOPS && strcmp(name, loop_names[loop]) != 0) {
+      loop++;
+    }
+    if (loop == TUNE_N_LOOPS) {
+      err = 1;
+      break;
+    }
+    grains[loop][bucket_of((int)min_size)] = grain;
+  }
+
+  fclose(in);
+  return err;
+}
+
+int tuning_save(const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    return 1;
+  }
+
+  fprintf(out, "# libstudent cilk_for grain sizes: <loop> <min size> <grain>\n");
+  for (int loop = 0; loop < TUNE_N_LOOPS; loop++) {
+    for (int bucket = 0; bucket < TUNE_N_BUCKETS; bucket++) {
+      if (grains[loop][bucket] > 0) {
+        fprintf(out, "%s %ld %d\n", loop_names[loop], 1l << bucket, grains[loop][bucket]);
+      }
+    }
+  }
+
+  return fclose(out) != 0;
+}
+
+void tuning_reset(void) {
+  memset(grains, 0, sizeof(grains));
+}
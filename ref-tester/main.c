@@ -8,6 +8,7 @@
 #include "../misc_utils.h" // init_impl
 #include "../serde.h"
 #include "../vtable.h"
+#include "../libstudent/include/simulate_ext.h"
 #include "./ref-tester.h"
 #include "./types.h"
 
@@ -35,6 +36,7 @@ struct opts {
   enum impl_opts simulator;
   bool reinit;
   bool concise_output;
+  bool precision_report;
 };
 
 static void open_spec_files(FILE **s_file, FILE **r_file, const char *sim_spec,
@@ -187,11 +189,12 @@ static void apply_defaults(struct opts *const o) {
   o->reinit = false;
   o->n_frames = 12;
   o->concise_output = false;
+  o->precision_report = false;
 }
 
 static void usage(void) {
   fprintf(stderr, "./ref-tester [-n num_frames] [-r | -s] [-i | -x "
-                  "expected_frames] [-o diff_output] sim_spec renderer_spec\n");
+                  "expected_frames] [-o diff_output] [-p] sim_spec renderer_spec\n");
 }
 
 /*
@@ -205,7 +208,7 @@ static int argparse(int argc, char *const argv[], struct opts *const o) {
 
   int ch;
 
-  while ((ch = getopt(argc, argv, "n:rhsix:o:c:")) != -1) {
+  while ((ch = getopt(argc, argv, "n:rhsix:o:c:p")) != -1) {
     switch (ch) {
     case 'n':
       if (1 != sscanf(optarg, "%zu", &o->n_frames))
@@ -230,6 +233,9 @@ static int argparse(int argc, char *const argv[], struct opts *const o) {
       o->concise_output = true;
       o->test_name = optarg;
       break;
+    case 'p':
+      o->precision_report = true;
+      break;
     case 'h':
     default:
       goto error;
@@ -304,6 +310,30 @@ static void apply_log_scale(frames_t *frames) {
   }
 }
 
+/*
+ * print how far the student simulator's fast precision mode drifts from its
+ * exact mode over the first n_frames frames of s_spec
+ */
+static error_e precision_report(const simulator_spec_t *s_spec, size_t n_frames) {
+  sim_precision_error_t *errors = malloc(sizeof(sim_precision_error_t) * n_frames);
+  if (simulator_precision_report(s_spec, (int)n_frames, errors)) {
+    fprintf(stderr, "Failed to set up simulators for precision report\n");
+    free(errors);
+    return BAD_ARGS;
+  }
+
+  printf("%5s %14s %14s %14s %14s\n", "frame", "max_pos_err", "rms_pos_err",
+         "max_rel_vel", "scene_extent");
+  for (size_t f = 0; f < n_frames; f++) {
+    const sim_precision_error_t e = errors[f];
+    printf("%5zu %14.6e %14.6e %14.6e %14.6e\n", f, e.max_pos_error,
+           e.rms_pos_error, e.max_rel_vel_error, e.scene_extent);
+  }
+
+  free(errors);
+  return NO_ERROR;
+}
+
 static error_e run(struct opts o) {
   vtable_t impl;
   switch (o.renderer) {
@@ -333,6 +363,10 @@ static error_e run(struct opts o) {
   fclose(r_f);
   fclose(s_f);
 
+  if (o.precision_report) {
+    return precision_report(&s_spec, o.n_frames);
+  }
+
   ref_out_t out;
   if (o.expected_frames == NULL) {
     if (!o.reinit && impl.simulate == staff_all().simulate) {